@@ -14,179 +14,198 @@ TODO:
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "../../src/term.h"
-
-// Disable some warnings for stb headers.
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wcast-qual"
-#pragma GCC diagnostic ignored "-Wstrict-overflow"
-#define STB_IMAGE_IMPLEMENTATION
-#include "ext/stb_image.h"
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#include "ext/stb_image_resize.h"
-#pragma GCC diagnostic pop
 #include "options.h"
 #include "write_ascii.h"
 
 #define MAX_IMG_SIZE 25000
+#define ANSI_CELL_LENGTH 22 // "\033[1;38;2;RRR;GGG;BBBm" and the character
 
 #define MACRO_STRLEN(s) (sizeof(s) / sizeof(s[0]))
 
-bool brightPixelFound;
-
 char scale[] = "$@&B%8WM#ZO0QoahkbdpqwmLCJUYXIjft/\\|()1{}[]l?zcvunxr!<>i;:*-+~_,\"^`'. ";
 unsigned int brightness_levels = MACRO_STRLEN(scale) - 2;
 
-unsigned char luminanceFromRGB(unsigned char r, unsigned char g, unsigned char b)
-{
-    return (unsigned char)(0.2126 * r + 0.7152 * g + 0.0722 * b);
-}
+// Lookup tables for emit_ascii(): three digits and a separator per colour component, a character per luminance
+static char digit_table[256][4];
+static char ascii_table[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
 
-unsigned char calc_ascii_char(PixelData *p, PixelData *brightPixel)
+static void init_tables(void)
 {
-    // Calc luminace and use to find Ascii char.
-    unsigned char ch = luminanceFromRGB(p->r, p->g, p->b);
-    int rescaled = ch * brightness_levels / 256;
-    if (ch > 100 && !brightPixelFound)
+    for (int i = 0; i < 256; i++)
     {
-        brightPixel->r = p->r;
-        brightPixel->g = p->g;
-        brightPixel->b = p->b;
-        brightPixelFound = true;
+        digit_table[i][0] = '0' + i / 100;
+        digit_table[i][1] = '0' + i / 10 % 10;
+        digit_table[i][2] = '0' + i % 10;
+        digit_table[i][3] = ';';
+        ascii_table[i] = scale[brightness_levels - i * brightness_levels / 256];
     }
-    return scale[brightness_levels - rescaled];
 }
 
-int getBrightPixel(char *filepath, int width, int height, PixelData *brightPixel)
+// The Rec. 709 luminance weights, 0.2126, 0.7152 and 0.0722, in 8 bit fixed point. They add up to 256,
+// so the sums fit in 16 bits. The pixels are 32 bit BGRA, eight at a time with SSE2 or NEON.
+#define LUMA_R 54
+#define LUMA_G 183
+#define LUMA_B 19
+
+static void calc_luminance_row(const unsigned char *bgra, int width, unsigned char *luminance)
 {
-    int rwidth, rheight, rchannels;
-    unsigned char *read_data = stbi_load(filepath, &rwidth, &rheight, &rchannels, 3);
+    int x = 0;
 
-    if (read_data == NULL)
-    {
-        fprintf(stderr, "Error reading image data!\n\n");
-        return -1;
-    }
-    brightPixelFound = false;
-    // Check for and do any needed image resizing...
-    PixelData *data;
-    if (width != rwidth || height != rheight)
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_setr_epi16(LUMA_B, LUMA_G, LUMA_R, 0, LUMA_B, LUMA_G, LUMA_R, 0);
+
+    for (; x + 8 <= width; x += 8)
     {
-        // 3 * uint8 for RGB!
-        unsigned char *new_data = malloc(3 * sizeof(unsigned char) * width * height);
-        int r = stbir_resize_uint8(
-            read_data, rwidth, rheight, 0,
-            new_data, width, height, 0, 3);
+        __m128i first = _mm_loadu_si128((const __m128i *)(bgra + x * 4));
+        __m128i second = _mm_loadu_si128((const __m128i *)(bgra + x * 4 + 16));
 
-        if (r == 0)
-        {
-            perror("Error resizing image:");
-            return -1;
-        }
-        stbi_image_free(read_data); // Free read_data.
-        data = (PixelData *)new_data;
+        // Per pixel two sums, b * LUMA_B + g * LUMA_G and r * LUMA_R, in neighbouring 32 bit lanes
+        __m128i s0 = _mm_madd_epi16(_mm_unpacklo_epi8(first, zero), weights);
+        __m128i s1 = _mm_madd_epi16(_mm_unpackhi_epi8(first, zero), weights);
+        __m128i s2 = _mm_madd_epi16(_mm_unpacklo_epi8(second, zero), weights);
+        __m128i s3 = _mm_madd_epi16(_mm_unpackhi_epi8(second, zero), weights);
+
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(s0), _mm_castsi128_ps(s1), _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(s0), _mm_castsi128_ps(s1), _MM_SHUFFLE(3, 1, 3, 1)));
+        __m128i low = _mm_srli_epi32(_mm_add_epi32(even, odd), 8);
+        even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(s2), _mm_castsi128_ps(s3), _MM_SHUFFLE(2, 0, 2, 0)));
+        odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(s2), _mm_castsi128_ps(s3), _MM_SHUFFLE(3, 1, 3, 1)));
+        __m128i high = _mm_srli_epi32(_mm_add_epi32(even, odd), 8);
+
+        __m128i words = _mm_packs_epi32(low, high);
+        _mm_storel_epi64((__m128i *)(luminance + x), _mm_packus_epi16(words, words));
     }
-    else
+#elif defined(__ARM_NEON)
+    for (; x + 8 <= width; x += 8)
     {
-        data = (PixelData *)read_data;
+        uint8x8x4_t pixels = vld4_u8(bgra + x * 4);
+        uint16x8_t sum = vmull_u8(pixels.val[0], vdup_n_u8(LUMA_B));
+        sum = vmlal_u8(sum, pixels.val[1], vdup_n_u8(LUMA_G));
+        sum = vmlal_u8(sum, pixels.val[2], vdup_n_u8(LUMA_R));
+        vst1_u8(luminance + x, vshrn_n_u16(sum, 8));
     }
+#endif
 
-    for (int d = 0; d < width * height; d++)
+    for (; x < width; x++)
     {
-        PixelData *c = data + d;
-
-        calc_ascii_char(c, brightPixel);
+        const unsigned char *c = bgra + x * 4;
+        luminance[x] = (unsigned char)((LUMA_B * c[0] + LUMA_G * c[1] + LUMA_R * c[2]) >> 8);
     }
-    stbi_image_free(data);
-    return 0;
 }
 
-int read_and_convert(char *filepath, ImageOptions *options, PixelData *brightPixel)
+static char *write_color(char *p, const char *prefix, size_t prefixLength, const PixelData *c)
 {
-    int rwidth, rheight, rchannels;
-    unsigned char *read_data = stbi_load(filepath, &rwidth, &rheight, &rchannels, 3);
-
-    if (read_data == NULL)
-    {
-        fprintf(stderr, "Error reading image data!\n\n");
-        return -1;
-    }
+    memcpy(p, prefix, prefixLength);
+    p += prefixLength;
+    memcpy(p, digit_table[c->r], 4);
+    memcpy(p + 4, digit_table[c->g], 4);
+    memcpy(p + 8, digit_table[c->b], 3);
+    p[11] = 'm';
+    return p + 12;
+}
 
-    unsigned int desired_width, desired_height;
-    desired_width = options->width;
-    desired_height = options->height;
+static int calc_indent(unsigned int width)
+{
+    int term_w, term_h;
+    getTermSize(&term_w, &term_h);
 
-    // Check for and do any needed image resizing...
-    PixelData *data;
-    if (desired_width != (unsigned)rwidth || desired_height != (unsigned)rheight)
-    {
-        // 3 * uint8 for RGB!
-        unsigned char *new_data = malloc(3 * sizeof(unsigned char) * desired_width * desired_height);
-        int r = stbir_resize_uint8(
-            read_data, rwidth, rheight, 0,
-            new_data, desired_width, desired_height, 0, 3);
+    int indent = ((term_w - (int)width) / 2) + 1;
+    return indent > 0 ? indent : 0;
+}
 
-        if (r == 0)
-        {
-            perror("Error resizing image:");
-            return -1;
-        }
-        stbi_image_free(read_data); // Free read_data.
-        data = (PixelData *)new_data;
-    }
-    else
-    {
-        data = (PixelData *)read_data;
-    }
+// The most emit_ascii() writes: an escape and a character per pixel, a reset, a newline and the indentation per row
+static size_t calc_ascii_size(unsigned int width, unsigned int height, int indent)
+{
+    return 3 + (size_t)height * ((size_t)width * ANSI_CELL_LENGTH + 5 + indent);
+}
 
-    int term_w, term_h;
-    getTermSize(&term_w, &term_h);
+// Writes one character per pixel, centered in the terminal, into a buffer of calc_ascii_size() bytes.
+// Colour escapes are only written when the colour changes. The luminance of each pixel is computed beforehand.
+static size_t emit_ascii(char *buffer, PixelData *data, const unsigned char *image_luminance, unsigned int width, unsigned int height, int indent, ImageOptions *options)
+{
+    static const char fg_prefix[] = "\033[1;38;2;";
+    static const char bg_prefix[] = "\033[48;2;";
+    char *p = buffer;
+    long previous = -1;
 
-    int indent = ((term_w - desired_width) / 2)+1;
+    pthread_once(&tables_once, init_tables);
 
     if (!options->suppress_header)
-        printf("\n\r");
-    printf("\n");
-    printf("%*s", indent, "");
-    for (unsigned int d = 0; d < desired_width * desired_height; d++)
     {
-        if (d % desired_width == 0 && d != 0)
+        *p++ = '\n';
+        *p++ = '\r';
+    }
+    *p++ = '\n';
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+        PixelData *row = data + (size_t)y * width;
+        const unsigned char *luminance = image_luminance + (size_t)y * width;
+
+        if (y > 0)
         {
             if (options->output_mode == SOLID_ANSI)
-                printf("\033[0m");
-            printf("\n");
-            printf("%*s", indent, "");
+            {
+                memcpy(p, "\033[0m", 4);
+                p += 4;
+                previous = -1;
+            }
+            *p++ = '\n';
         }
+        memset(p, ' ', indent);
+        p += indent;
 
-        PixelData *c = data + d;
-
-        switch (options->output_mode)
+        for (unsigned int x = 0; x < width; x++)
         {
-        case ASCII:
-            printf("%c", calc_ascii_char(c, brightPixel));
-            break;
-        case ANSI:
-            printf("\033[1;38;2;%03u;%03u;%03um%c", c->r, c->g, c->b, calc_ascii_char(c, brightPixel));
-            break;
-        case SOLID_ANSI:
-            printf("\033[48;2;%03u;%03u;%03um ", c->r, c->g, c->b);
-            calc_ascii_char(c, brightPixel);
-            break;
-        default:
-            break;
+            PixelData *c = row + x;
+            long color = ((long)c->r << 16) | (c->g << 8) | c->b;
+
+            switch (options->output_mode)
+            {
+            case ASCII:
+                *p++ = ascii_table[luminance[x]];
+                break;
+            case ANSI:
+                if (color != previous)
+                    p = write_color(p, fg_prefix, sizeof(fg_prefix) - 1, c);
+                *p++ = ascii_table[luminance[x]];
+                break;
+            case SOLID_ANSI:
+                if (color != previous)
+                    p = write_color(p, bg_prefix, sizeof(bg_prefix) - 1, c);
+                *p++ = ' ';
+                break;
+            default:
+                break;
+            }
+            previous = color;
         }
     }
     if (options->output_mode == SOLID_ANSI)
-        printf("\033[0m");
-    printf("\n");
+    {
+        memcpy(p, "\033[0m", 4);
+        p += 4;
+    }
+    *p++ = '\n';
 
-    stbi_image_free(data);
-    return 0;
+    return p - buffer;
 }
 
-int output_ascii(char *pathToImgFile, int height, int width, PixelData *brightPixel)
+// Renders an already decoded and sized picture into a buffer that is written out later.
+// The pixels are 32 bit BGRA rows, top row first, the way the player keeps its covers.
+char *render_ascii(const unsigned char *pixels, int width, int height, int pitch, size_t *length)
 {
     ImageOptions opts = {
         .output_mode = ANSI,
@@ -195,25 +214,45 @@ int output_ascii(char *pathToImgFile, int height, int width, PixelData *brightPi
         .squashing_enabled = true,
         .suppress_header = true,
     };
+    char *buffer = NULL;
+
+    *length = 0;
+    if (pixels == NULL || width <= 0 || height <= 0 || width > MAX_IMG_SIZE || height > MAX_IMG_SIZE)
+        return NULL;
+    opts.width = width;
+    opts.height = height;
+
+    PixelData *data = malloc(sizeof(PixelData) * width * height);
+    unsigned char *luminance = malloc((size_t)width * height);
+    if (data == NULL || luminance == NULL)
+    {
+        free(data);
+        free(luminance);
+        return NULL;
+    }
 
-    if (width > MAX_IMG_SIZE)
+    for (int y = 0; y < height; y++)
     {
-        fprintf(stderr, "[ERR] Width exceeds maximum image size!\n");
-        return -1;
+        const unsigned char *row = pixels + (size_t)y * pitch;
+        calc_luminance_row(row, width, luminance + (size_t)y * width);
+        for (int x = 0; x < width; x++)
+        {
+            PixelData *c = &data[y * width + x];
+            c->b = row[x * 4];
+            c->g = row[x * 4 + 1];
+            c->r = row[x * 4 + 2];
+        }
     }
-    opts.width = width--; // compensate, first character on each line is going to be blank
 
-    if (height > MAX_IMG_SIZE)
+    int indent = calc_indent(width);
+    buffer = malloc(2 + calc_ascii_size(width, height, indent));
+    if (buffer != NULL)
     {
-        fprintf(stderr, "[ERR] Height exceeds maximum image size!\n");
-        return -1;
+        buffer[0] = '\n';
+        buffer[1] = '\r';
+        *length = 2 + emit_ascii(buffer + 2, data, luminance, width, height, indent, &opts);
     }
-    opts.height = height;
-    brightPixelFound = false;
-    printf("\n\r");
-    int ret = read_and_convert(pathToImgFile, &opts, brightPixel);
-    if (ret == -1)
-        //  fprintf(stderr, "Failed to convert image: %s\n", pathToImgFile);
-        printf("\033[0m");
-    return 0;
-}
\ No newline at end of file
+    free(data);
+    free(luminance);
+    return buffer;
+}
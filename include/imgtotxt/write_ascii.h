@@ -1,6 +1,7 @@
 #ifndef C_H
 #define C_H
 #include <stdbool.h>
+#include <stddef.h>
 #include "options.h"
 
 /* This ifdef allows the header to be used from both C and C++. */
@@ -17,8 +18,7 @@ extern "C"
         unsigned char b;
     } PixelData;
 #endif
-    int getBrightPixel(char *filepath, int width, int height, PixelData *brightPixel);
-    int output_ascii(char *pathToImgFile, int height, int width, PixelData *brightPixel);
+    char *render_ascii(const unsigned char *pixels, int width, int height, int pitch, size_t *length);
 #ifdef __cplusplus
 }
 #endif
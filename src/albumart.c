@@ -4,9 +4,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <libavformat/avformat.h>
 #include "file.h"
 #include "../include/imgtotxt/options.h"
 #include "metadata.h"
@@ -16,53 +16,39 @@
 #include "cache.h"
 #include "chafafunc.h"
 
-FIBITMAP *bitmap;
+static pthread_mutex_t renderMutex = PTHREAD_MUTEX_INITIALIZER;
 
-int extractCoverCommand(const char *inputFilePath, const char *outputFilePath)
+// Copies the picture embedded in the file's tags, music files store it as a stream with a single packet
+int extractEmbeddedCover(const char *inputFilePath, unsigned char **data, int *size)
 {
-    const int COMMAND_SIZE = 1000;
-    char command[COMMAND_SIZE];
-    int status;
+    AVFormatContext *formatContext = NULL;
+    int res = -1;
 
-    // Replace $ with \$
-    char *escapedInputFilePath = escapeFilePath(inputFilePath);
-    char *escapedOutputFilePath = escapeFilePath(outputFilePath);
+    *data = NULL;
+    *size = 0;
 
-    snprintf(command, COMMAND_SIZE, "ffmpeg -y -i \"%s\" -an -vcodec copy \"%s\"", escapedInputFilePath, escapedOutputFilePath);
-
-    free(escapedInputFilePath);
-    free(escapedOutputFilePath);
-
-    pid_t pid = fork();
+    if (avformat_open_input(&formatContext, inputFilePath, NULL, NULL) != 0)
+        return -1;
 
-    if (pid == -1)
-    {
-        perror("fork failed");
-        exit(EXIT_FAILURE);
-    }
-    else if (pid == 0)
-    {
-        // Child process
-        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
-        exit(EXIT_SUCCESS);
-    }
-    else
+    for (unsigned int i = 0; i < formatContext->nb_streams; i++)
     {
-        // Parent process
-        waitpid(pid, &status, 0);
-    }
+        AVStream *stream = formatContext->streams[i];
 
-    FILE *file = fopen(outputFilePath, "r");
+        if (!(stream->disposition & AV_DISPOSITION_ATTACHED_PIC) || stream->attached_pic.size <= 0)
+            continue;
 
-    if (file != NULL)
-    {
-        fclose(file);
-        return 1;
-    }
-    else
-    {
-        return -1;
+        *data = malloc(stream->attached_pic.size);
+        if (*data != NULL)
+        {
+            memcpy(*data, stream->attached_pic.data, stream->attached_pic.size);
+            *size = stream->attached_pic.size;
+            res = 0;
+        }
+        break;
     }
+
+    avformat_close_input(&formatContext);
+    return res;
 }
 
 int isAudioFile(const char *filename)
@@ -161,64 +147,6 @@ char *findFirstPathWithAudioFile(const char *path)
     return audioDirectory;
 }
 
-char *findLargestImageFileRecursive(const char *directoryPath, char *largestImageFile, off_t *largestFileSize)
-{
-    DIR *directory = opendir(directoryPath);
-    struct dirent *entry;
-    struct stat fileStats;
-
-    if (directory == NULL)
-    {
-        fprintf(stderr, "Failed to open directory: %s\n", directoryPath);
-        return largestImageFile;
-    }
-
-    while ((entry = readdir(directory)) != NULL)
-    {
-        char filePath[MAXPATHLEN];
-        snprintf(filePath, MAXPATHLEN, "%s/%s", directoryPath, entry->d_name);
-
-        if (stat(filePath, &fileStats) == -1)
-        {
-            // fprintf(stderr, "Failed to get file stats: %s\n", filePath);
-            continue;
-        }
-
-        if (S_ISDIR(fileStats.st_mode))
-        {
-            // Skip "." and ".." directories
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            {
-                continue;
-            }
-
-            // Recursive call to process subdirectories
-            largestImageFile = findLargestImageFileRecursive(filePath, largestImageFile, largestFileSize);
-        }
-        else if (S_ISREG(fileStats.st_mode))
-        {
-            // Check if the entry is an image file and has a larger size than the current largest image file
-            char *extension = strrchr(entry->d_name, '.');
-            if (extension != NULL && (strcasecmp(extension, ".jpg") == 0 || strcasecmp(extension, ".jpeg") == 0 ||
-                                      strcasecmp(extension, ".png") == 0 || strcasecmp(extension, ".gif") == 0))
-            {
-                if (fileStats.st_size > *largestFileSize)
-                {
-                    *largestFileSize = fileStats.st_size;
-                    if (largestImageFile != NULL)
-                    {
-                        free(largestImageFile);
-                    }
-                    largestImageFile = strdup(filePath);
-                }
-            }
-        }
-    }
-
-    closedir(directory);
-    return largestImageFile;
-}
-
 int calcIdealImgSize(int *width, int *height, const int visualizerHeight, const int metatagHeight)
 {
     int term_w, term_h;
@@ -239,19 +167,127 @@ int calcIdealImgSize(int *width, int *height, const int visualizerHeight, const
     return 0;
 }
 
-int displayCover(SongData *songdata, int width, int height, bool ansii)
+// The output for this size and mode, rendered unless it is one of the last COVER_RENDERED_VARIANTS asked for.
+// The caller holds renderMutex.
+RenderedCover *getRenderedCover(CoverArt *cover, int width, int height, bool ansii)
 {
-    if (!ansii)
+    int termWidth, termHeight;
+
+    getTermSize(&termWidth, &termHeight);
+
+    RenderedCover *slot = &cover->rendered[0];
+    for (int i = 0; i < COVER_RENDERED_VARIANTS; i++)
     {
-        clearScreen();
-        printBitmapCentered(songdata->cover, width - 1, height - 2);
+        RenderedCover *entry = &cover->rendered[i];
+
+        if (entry->output != NULL && entry->width == width && entry->height == height &&
+            entry->termWidth == termWidth && entry->ascii == ansii)
+        {
+            entry->lastUsed = ++cover->renderedUses;
+            return entry;
+        }
+
+        if (slot->output != NULL && (entry->output == NULL || entry->lastUsed < slot->lastUsed))
+            slot = entry;
+    }
+
+    char *rendered = NULL;
+    size_t length = 0;
+
+    if (!ansii && useKittyGraphics())
+    {
+        FIBITMAP *scaled = getScaledCover(cover, width - 1, height - 2);
+        if (scaled == NULL)
+            return NULL;
+
+        // Only the placement is kept, displayCover() uploads the image the first time it is shown
+        if (cover->kittyImage == 0)
+            cover->kittyImage = newKittyImageId();
+        GString *printable = renderKittyPlacement(cover->kittyImage, FreeImage_GetWidth(scaled), FreeImage_GetHeight(scaled), width - 1, height - 2);
+        if (printable != NULL)
+        {
+            length = printable->len;
+            rendered = g_string_free(printable, FALSE);
+        }
+    }
+    else if (!ansii)
+    {
+        GString *printable = renderBitmapCentered(getScaledCover(cover, width - 1, height - 2), width - 1, height - 2);
+        if (printable != NULL)
+        {
+            length = printable->len;
+            rendered = g_string_free(printable, FALSE);
+        }
     }
     else
     {
+        FIBITMAP *resized = getResizedCover(cover, width - 1, height - 2);
+        if (resized != NULL)
+            rendered = render_ascii(FreeImage_GetBits(resized), width - 1, height - 2, FreeImage_GetPitch(resized), &length);
+    }
+
+    if (rendered == NULL)
+        return NULL;
+
+    free(slot->output);
+    slot->output = rendered;
+    slot->length = length;
+    slot->width = width;
+    slot->height = height;
+    slot->termWidth = termWidth;
+    slot->ascii = ansii;
+    slot->lastUsed = ++cover->renderedUses;
+    return slot;
+}
+
+// Renders the cover unless that was done already for this size and mode, the songs of an album share the result
+int renderCover(SongData *songdata, int width, int height, bool ansii)
+{
+    CoverArt *cover = songdata->coverArt;
+
+    if (cover == NULL || cover->bitmap == NULL)
+        return -1;
+
+    pthread_mutex_lock(&renderMutex);
+    RenderedCover *rendered = getRenderedCover(cover, width, height, ansii);
+    pthread_mutex_unlock(&renderMutex);
+
+    return (rendered != NULL) ? 0 : -1;
+}
+
+int displayCover(SongData *songdata, int width, int height, bool ansii)
+{
+    CoverArt *cover = songdata->coverArt;
+
+    if (!ansii)
+        clearScreen();
+    else
         cursorJump(1);
-        PixelData pixel = {*songdata->red, *songdata->green, *songdata->blue};
-        output_ascii(songdata->coverArtPath, height - 2, width - 1, &pixel);
+
+    if (cover != NULL && cover->bitmap != NULL)
+    {
+        pthread_mutex_lock(&renderMutex);
+
+        RenderedCover *rendered = getRenderedCover(cover, width, height, ansii);
+
+        // A kitty terminal gets the image again only when it has to be shown larger than it was sent
+        if (rendered != NULL && !ansii && cover->kittyImage != 0)
+        {
+            FIBITMAP *scaled = getScaledCover(cover, width - 1, height - 2);
+            if (scaled != NULL && ((int)FreeImage_GetWidth(scaled) > cover->kittyWidth || (int)FreeImage_GetHeight(scaled) > cover->kittyHeight))
+            {
+                // The upload is written straight to the terminal, what is buffered has to go first
+                fflush(stdout);
+                sendKittyImage(scaled, cover->kittyImage);
+                cover->kittyWidth = FreeImage_GetWidth(scaled);
+                cover->kittyHeight = FreeImage_GetHeight(scaled);
+            }
+        }
+
+        if (rendered != NULL)
+            fwrite(rendered->output, 1, rendered->length, stdout);
+        pthread_mutex_unlock(&renderMutex);
     }
     fputc('\n', stdout);
     return 0;
-}
\ No newline at end of file
+}
@@ -7,14 +7,12 @@
 #include "../include/imgtotxt/write_ascii.h"
 #include "songloader.h"
 
-int extractCoverCommand(const char *inputFilePath, const char *outputFilePath);
-
-char *findLargestImageFileRecursive(const char *directoryPath, char *largestImageFile, off_t *largestFileSize);
-
-int displayAlbumArt(const char *filepath, int width, int height, bool coverAnsi, PixelData *brightPixel);
+int extractEmbeddedCover(const char *inputFilePath, unsigned char **data, int *size);
 
 int calcIdealImgSize(int *width, int *height, const int visualizerHeight, const int metatagHeight);
 
+int renderCover(SongData *songdata, int width, int height, bool ascii);
+
 int displayCover(SongData *songdata, int width, int height, bool ascii);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "beatdetect.h"
+
+/*
+Finds onsets from the spectral flux, how much the bars rose since the last frame. The bars are split into
+BEAT_BANDS bands, and a band has an onset when its flux is more than BEAT_SENSITIVITY standard deviations
+above its mean over the last BEAT_HISTORY frames. Mean and deviation come from sums that are updated as
+frames enter and leave the history, so a frame costs one pass over the bars and a few steps per band.
+Nothing here draws or reads audio, the detector can be fed magnitudes from a decoded file.
+*/
+
+void freeBeatDetector(BeatDetector *detector)
+{
+    free(detector->previous);
+    memset(detector, 0, sizeof(BeatDetector));
+}
+
+// A different number of bars starts the history over
+int prepareBeatDetector(BeatDetector *detector, const float *magnitudes, int numBars)
+{
+    if (numBars == detector->numBars && detector->previous != NULL)
+        return 0;
+
+    freeBeatDetector(detector);
+
+    detector->previous = malloc(sizeof(float) * numBars);
+    if (detector->previous == NULL)
+        return -1;
+
+    memcpy(detector->previous, magnitudes, sizeof(float) * numBars);
+    detector->numBars = numBars;
+    return 1;
+}
+
+int detectBeat(BeatDetector *detector, const float *magnitudes, int numBars)
+{
+    double flux[BEAT_BANDS] = {0.0};
+    int beats = 0;
+
+    if (numBars < BEAT_BANDS)
+        return 0;
+
+    // The first frame only sets what the next one is compared with
+    if (prepareBeatDetector(detector, magnitudes, numBars) != 0)
+        return 0;
+
+    for (int i = 0; i < numBars; i++)
+    {
+        float rise = magnitudes[i] - detector->previous[i];
+        if (rise > 0.0f)
+            flux[i * BEAT_BANDS / numBars] += rise;
+        detector->previous[i] = magnitudes[i];
+    }
+
+    for (int band = 0; band < BEAT_BANDS; band++)
+    {
+        if (detector->count > 0)
+        {
+            double mean = detector->sum[band] / detector->count;
+            double variance = detector->sumSquares[band] / detector->count - mean * mean;
+            double threshold = mean + BEAT_SENSITIVITY * sqrt(variance > 0.0 ? variance : 0.0);
+
+            if (detector->count == BEAT_HISTORY && flux[band] > threshold && flux[band] > BEAT_MIN_FLUX)
+                beats |= 1 << band;
+        }
+
+        // The oldest value leaves the sums as the new one comes in
+        double oldest = (detector->count == BEAT_HISTORY) ? detector->history[band][detector->position] : 0.0;
+        detector->history[band][detector->position] = flux[band];
+        detector->sum[band] += flux[band] - oldest;
+        detector->sumSquares[band] += flux[band] * flux[band] - oldest * oldest;
+    }
+
+    detector->position = (detector->position + 1) % BEAT_HISTORY;
+    if (detector->count < BEAT_HISTORY)
+        detector->count++;
+
+    // Once per round through the history the sums are added up again, so rounding errors can't pile up
+    if (detector->position == 0)
+    {
+        for (int band = 0; band < BEAT_BANDS; band++)
+        {
+            detector->sum[band] = 0.0;
+            detector->sumSquares[band] = 0.0;
+            for (int i = 0; i < BEAT_HISTORY; i++)
+            {
+                detector->sum[band] += detector->history[band][i];
+                detector->sumSquares[band] += detector->history[band][i] * detector->history[band][i];
+            }
+        }
+    }
+
+    return beats;
+}
@@ -0,0 +1,25 @@
+#ifndef BEATDETECT_H
+#define BEATDETECT_H
+
+#define BEAT_BANDS 4
+#define BEAT_HISTORY 32
+#define BEAT_SENSITIVITY 1.5
+#define BEAT_MIN_FLUX 1.0
+
+typedef struct
+{
+    int numBars;
+    float *previous;                        // The magnitudes of the last frame
+    double history[BEAT_BANDS][BEAT_HISTORY]; // The flux of each band over the last frames
+    double sum[BEAT_BANDS];
+    double sumSquares[BEAT_BANDS];
+    int position;
+    int count;
+} BeatDetector;
+
+// Returns a bit per band that has an onset in this frame, the lowest band is bit 0
+int detectBeat(BeatDetector *detector, const float *magnitudes, int numBars);
+
+void freeBeatDetector(BeatDetector *detector);
+
+#endif
@@ -8,14 +8,56 @@
 #include <io.h>
 #else
 #include <sys/ioctl.h> /* ioctl */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #endif
 
+#define CHAFA_CANVAS_CACHE_SIZE 4
+#define KITTY_CHUNK_SIZE 4096
+#define KITTY_PENDING_DELETES 16
+#define KITTY_PENDING_SHARED 16
+#define KITTY_SHARED_TIMEOUT_US 2000000 /* A terminal that hasn't read a shared upload by then never will */
+
 typedef struct
 {
     gint width_cells, height_cells;
     gint width_pixels, height_pixels;
 } TermSize;
 
+typedef struct
+{
+    ChafaCanvasConfig *config;
+    ChafaCanvas *canvas;
+    gint width_cells, height_cells;
+    gint cell_width, cell_height;
+    unsigned int last_used;
+} CachedCanvas;
+
+/* The terminal is examined once, canvases are kept per geometry so that a redraw only draws pixels */
+
+typedef struct
+{
+    gboolean detected;
+    ChafaTermInfo *term_info;
+    ChafaCanvasMode mode;
+    ChafaPixelMode pixel_mode;
+    ChafaSymbolMap *symbol_map;
+    gboolean have_term_size;
+    TermSize term_size;
+    CachedCanvas canvases[CHAFA_CANVAS_CACHE_SIZE];
+    unsigned int uses;
+    unsigned int kitty_next_id;
+    unsigned int kitty_deletes[KITTY_PENDING_DELETES]; /* Images to drop from the terminal with the next upload */
+    int kitty_num_deletes;
+    unsigned int kitty_shared[KITTY_PENDING_SHARED]; /* Images sent through shared memory the terminal may not have read */
+    gint64 kitty_shared_times[KITTY_PENDING_SHARED];
+    int kitty_num_shared;
+} Renderer;
+
+static Renderer renderer;
+static pthread_mutex_t rendererMutex = PTHREAD_MUTEX_INITIALIZER;
+
 static void detect_terminal(ChafaTermInfo **term_info_out, ChafaCanvasMode *mode_out, ChafaPixelMode *pixel_mode_out)
 {
     ChafaCanvasMode mode;
@@ -149,45 +191,103 @@ tty_init(void)
 #endif
 }
 
-static GString *
-convert_image(const void *pixels, gint pix_width, gint pix_height,
-              gint pix_rowstride, ChafaPixelType pixel_type,
-              gint width_cells, gint height_cells,
-              gint cell_width, gint cell_height)
+/* The caller holds rendererMutex */
+static void
+init_renderer(void)
 {
-    ChafaTermInfo *term_info;
-    ChafaCanvasMode mode;
-    ChafaPixelMode pixel_mode;
-    ChafaSymbolMap *symbol_map;
-    ChafaCanvasConfig *config;
-    ChafaCanvas *canvas;
-    GString *printable;
+    if (renderer.detected)
+        return;
 
-    detect_terminal(&term_info, &mode, &pixel_mode);
+    tty_init();
+    detect_terminal(&renderer.term_info, &renderer.mode, &renderer.pixel_mode);
 
     /* Specify the symbols we want */
 
-    symbol_map = chafa_symbol_map_new();
-    chafa_symbol_map_add_by_tags(symbol_map, CHAFA_SYMBOL_TAG_BLOCK);
+    renderer.symbol_map = chafa_symbol_map_new();
+    chafa_symbol_map_add_by_tags(renderer.symbol_map, CHAFA_SYMBOL_TAG_BLOCK);
+    renderer.detected = TRUE;
+}
+
+static void
+get_cached_tty_size(TermSize *term_size_out)
+{
+    pthread_mutex_lock(&rendererMutex);
+    if (!renderer.have_term_size)
+    {
+        get_tty_size(&renderer.term_size);
+        renderer.have_term_size = TRUE;
+    }
+    *term_size_out = renderer.term_size;
+    pthread_mutex_unlock(&rendererMutex);
+}
+
+/* The caller holds rendererMutex */
+static ChafaCanvas *
+get_canvas(gint width_cells, gint height_cells, gint cell_width, gint cell_height)
+{
+    CachedCanvas *slot = &renderer.canvases[0];
+
+    for (int i = 0; i < CHAFA_CANVAS_CACHE_SIZE; i++)
+    {
+        CachedCanvas *cached = &renderer.canvases[i];
+
+        if (cached->canvas != NULL && cached->width_cells == width_cells && cached->height_cells == height_cells &&
+            cached->cell_width == cell_width && cached->cell_height == cell_height)
+        {
+            cached->last_used = ++renderer.uses;
+            return cached->canvas;
+        }
+
+        /* Otherwise replace an empty slot or the least recently used one */
+
+        if (slot->canvas != NULL && (cached->canvas == NULL || cached->last_used < slot->last_used))
+            slot = cached;
+    }
+
+    if (slot->canvas != NULL)
+    {
+        chafa_canvas_unref(slot->canvas);
+        chafa_canvas_config_unref(slot->config);
+    }
 
     /* Set up a configuration with the symbols and the canvas size in characters */
 
-    config = chafa_canvas_config_new();
-    chafa_canvas_config_set_canvas_mode(config, mode);
-    chafa_canvas_config_set_pixel_mode(config, pixel_mode);
-    chafa_canvas_config_set_geometry(config, width_cells, height_cells);
-    chafa_canvas_config_set_symbol_map(config, symbol_map);
+    slot->config = chafa_canvas_config_new();
+    chafa_canvas_config_set_canvas_mode(slot->config, renderer.mode);
+    chafa_canvas_config_set_pixel_mode(slot->config, renderer.pixel_mode);
+    chafa_canvas_config_set_geometry(slot->config, width_cells, height_cells);
+    chafa_canvas_config_set_symbol_map(slot->config, renderer.symbol_map);
 
     if (cell_width > 0 && cell_height > 0)
     {
         /* We know the pixel dimensions of each cell. Store it in the config. */
 
-        chafa_canvas_config_set_cell_geometry(config, cell_width, cell_height);
+        chafa_canvas_config_set_cell_geometry(slot->config, cell_width, cell_height);
     }
 
-    /* Create canvas */
+    slot->canvas = chafa_canvas_new(slot->config);
+    slot->width_cells = width_cells;
+    slot->height_cells = height_cells;
+    slot->cell_width = cell_width;
+    slot->cell_height = cell_height;
+    slot->last_used = ++renderer.uses;
 
-    canvas = chafa_canvas_new(config);
+    return slot->canvas;
+}
+
+static GString *
+convert_image(const void *pixels, gint pix_width, gint pix_height,
+              gint pix_rowstride, ChafaPixelType pixel_type,
+              gint width_cells, gint height_cells,
+              gint cell_width, gint cell_height)
+{
+    ChafaCanvas *canvas;
+    GString *printable;
+
+    pthread_mutex_lock(&rendererMutex);
+
+    init_renderer();
+    canvas = get_canvas(width_cells, height_cells, cell_width, cell_height);
 
     /* Draw pixels to the canvas */
 
@@ -199,22 +299,44 @@ convert_image(const void *pixels, gint pix_width, gint pix_height,
                                  pix_rowstride);
 
     /* Build printable string */
-    printable = g_string_new(NULL);
-    printable = chafa_canvas_print(canvas, term_info);
-
-    /* Clean up and return */
-
-    chafa_canvas_unref(canvas);
-    chafa_canvas_config_unref(config);
-    chafa_symbol_map_unref(symbol_map);
-    chafa_term_info_unref(term_info);
-    canvas = NULL;
-    config = NULL;
-    symbol_map = NULL;
-    term_info = NULL;
+    printable = chafa_canvas_print(canvas, renderer.term_info);
+
+    pthread_mutex_unlock(&rendererMutex);
     return printable;
 }
 
+/* The next render asks the terminal for its size again */
+void invalidateTermSize()
+{
+    pthread_mutex_lock(&rendererMutex);
+    renderer.have_term_size = FALSE;
+    pthread_mutex_unlock(&rendererMutex);
+}
+
+static void write_kitty_deletes(void);
+static void unlink_kitty_shared(gboolean all);
+
+void freeRenderer()
+{
+    pthread_mutex_lock(&rendererMutex);
+    write_kitty_deletes();
+    unlink_kitty_shared(TRUE);
+    for (int i = 0; i < CHAFA_CANVAS_CACHE_SIZE; i++)
+    {
+        if (renderer.canvases[i].canvas == NULL)
+            continue;
+        chafa_canvas_unref(renderer.canvases[i].canvas);
+        chafa_canvas_config_unref(renderer.canvases[i].config);
+    }
+    if (renderer.detected)
+    {
+        chafa_symbol_map_unref(renderer.symbol_map);
+        chafa_term_info_unref(renderer.term_info);
+    }
+    memset(&renderer, 0, sizeof(renderer));
+    pthread_mutex_unlock(&rendererMutex);
+}
+
 void printImage(const char *image_path, int width, int height)
 {
     FreeImage_Initialise(false);
@@ -260,8 +382,7 @@ void printImage(const char *image_path, int width, int height)
     gint cell_width = -1, cell_height = -1;
     gint width_cells, height_cells;
 
-    tty_init();
-    get_tty_size(&term_size);
+    get_cached_tty_size(&term_size);
 
     if (term_size.width_cells > 0 && term_size.height_cells > 0 && term_size.width_pixels > 0 && term_size.height_pixels > 0)
     {
@@ -276,7 +397,6 @@ void printImage(const char *image_path, int width, int height)
     chafa_calc_canvas_geometry(pix_width, pix_height, &width_cells, &height_cells, font_ratio, TRUE, FALSE);
 
     /* Convert the image to a printable string */
-    printable = g_string_new(NULL);
     printable = convert_image(pixels, pix_width, pix_height, pix_width * n_channels, CHAFA_PIXEL_BGRA8_UNASSOCIATED,
                               width, height, cell_width, cell_height);
 
@@ -319,6 +439,36 @@ FIBITMAP *getBitmap(const char *image_path)
     return bitmap;
 }
 
+FIBITMAP *getBitmapFromMemory(unsigned char *data, int size)
+{
+    if (data == NULL || size <= 0)
+        return NULL;
+
+    FreeImage_Initialise(false);
+    FIMEMORY *memory = FreeImage_OpenMemory(data, size);
+    if (memory == NULL)
+    {
+        return NULL;
+    }
+    FREE_IMAGE_FORMAT image_format = FreeImage_GetFileTypeFromMemory(memory, 0);
+    if (image_format == FIF_UNKNOWN)
+    {
+        FreeImage_CloseMemory(memory);
+        return NULL;
+    }
+    FIBITMAP *image = FreeImage_LoadFromMemory(image_format, memory, 0);
+    FreeImage_CloseMemory(memory);
+    if (!image)
+    {
+        return NULL;
+    }
+    FIBITMAP *bitmap = FreeImage_ConvertTo32Bits(image);
+    FreeImage_FlipVertical(bitmap);
+    FreeImage_Unload(image);
+
+    return bitmap;
+}
+
 void printBitmap(FIBITMAP *bitmap, int width, int height)
 {
     if (bitmap == NULL)
@@ -337,8 +487,7 @@ void printBitmap(FIBITMAP *bitmap, int width, int height)
     gint cell_width = -1, cell_height = -1;
     gint width_cells, height_cells;
 
-    tty_init();
-    get_tty_size(&term_size);
+    get_cached_tty_size(&term_size);
 
     if (term_size.width_cells > 0 && term_size.height_cells > 0 && term_size.width_pixels > 0 && term_size.height_pixels > 0)
     {
@@ -353,7 +502,6 @@ void printBitmap(FIBITMAP *bitmap, int width, int height)
     chafa_calc_canvas_geometry(pix_width, pix_height, &width_cells, &height_cells, font_ratio, TRUE, FALSE);
 
     /* Convert the image to a printable string */
-    printable = g_string_new(NULL);
     printable = convert_image(pixels, pix_width, pix_height, pix_width * n_channels, CHAFA_PIXEL_BGRA8_UNASSOCIATED,
                               width, height, cell_width, cell_height);
 
@@ -363,11 +511,12 @@ void printBitmap(FIBITMAP *bitmap, int width, int height)
     g_string_free(printable, TRUE);
 }
 
-void printBitmapCentered(FIBITMAP *bitmap, int width, int height)
+// Same output as printBitmapCentered() but kept in a string, so it can be prepared before it is shown
+GString *renderBitmapCentered(FIBITMAP *bitmap, int width, int height)
 {
     if (bitmap == NULL)
     {
-        return;
+        return NULL;
     }
     int pix_width = FreeImage_GetWidth(bitmap);
     int pix_height = FreeImage_GetHeight(bitmap);
@@ -378,97 +527,454 @@ void printBitmapCentered(FIBITMAP *bitmap, int width, int height)
     GString *printable;
     gint cell_width = -1, cell_height = -1;
 
-    tty_init();
-    get_tty_size(&term_size);
+    get_cached_tty_size(&term_size);
 
     if (term_size.width_cells > 0 && term_size.height_cells > 0 && term_size.width_pixels > 0 && term_size.height_pixels > 0)
     {
         cell_width = term_size.width_pixels / term_size.width_cells;
         cell_height = term_size.height_pixels / term_size.height_cells;
     }
-    printable = g_string_new(NULL);
     printable = convert_image(pixels, pix_width, pix_height, pix_width * n_channels, CHAFA_PIXEL_BGRA8_UNASSOCIATED,
                               width, height, cell_width, cell_height);
-    g_string_append_c(printable, '\0');
     const gchar *delimiters = "\n";
     gchar **lines = g_strsplit(printable->str, delimiters, -1);
+    GString *centered = g_string_sized_new(printable->len + height * (term_size.width_cells / 2 + 2));
 
     int indentation = ((term_size.width_cells - width) / 2) + 1;
     for (int i = 0; lines[i] != NULL; i++)
     {
-        printf("\n%*s%s", indentation, "", lines[i]);
+        g_string_append_printf(centered, "\n%*s%s", indentation, "", lines[i]);
     }
     g_strfreev(lines);
     g_string_free(printable, TRUE);
+    return centered;
 }
 
-unsigned char luminance(unsigned char r, unsigned char g, unsigned char b)
+void printBitmapCentered(FIBITMAP *bitmap, int width, int height)
 {
-    return (unsigned char)(0.2126 * r + 0.7152 * g + 0.0722 * b);
+    GString *centered = renderBitmapCentered(bitmap, width, height);
+    if (centered == NULL)
+    {
+        return;
+    }
+    fwrite(centered->str, sizeof(char), centered->len, stdout);
+    g_string_free(centered, TRUE);
 }
 
-void checkIfBrightPixel(unsigned char r, unsigned char g, unsigned char b, bool *found)
+// The pixel size worth handing to chafa for a canvas of width x height cells, never larger than the bitmap
+void calcScaledSize(FIBITMAP *bitmap, int width, int height, int *scaled_width, int *scaled_height)
 {
-    // Calc luminace and use to find Ascii char.
-    unsigned char ch = luminance(r, g, b);
-    if (ch > 100 && !(r == 255 && g == 255 && b == 255))
+    TermSize term_size;
+    gint cell_width = 8, cell_height = 16;
+    int pix_width = FreeImage_GetWidth(bitmap);
+    int pix_height = FreeImage_GetHeight(bitmap);
+
+    *scaled_width = pix_width;
+    *scaled_height = pix_height;
+    if (width <= 0 || height <= 0)
+        return;
+
+    get_cached_tty_size(&term_size);
+
+    if (term_size.width_cells > 0 && term_size.height_cells > 0 && term_size.width_pixels > 0 && term_size.height_pixels > 0)
     {
-        *found = true;
+        cell_width = term_size.width_pixels / term_size.width_cells;
+        cell_height = term_size.height_pixels / term_size.height_cells;
     }
+
+    double scale = fmin((double)(width * cell_width) / pix_width, (double)(height * cell_height) / pix_height);
+    if (scale >= 1.0)
+        return;
+
+    *scaled_width = (int)(pix_width * scale) > 0 ? (int)(pix_width * scale) : 1;
+    *scaled_height = (int)(pix_height * scale) > 0 ? (int)(pix_height * scale) : 1;
+}
+
+/* Kitty keeps uploaded images by id. A cover is sent once and a redraw only places it again,
+ * so what is written per redraw doesn't depend on the size of the image. */
+
+bool useKittyGraphics()
+{
+    pthread_mutex_lock(&rendererMutex);
+    init_renderer();
+    bool kitty = (renderer.pixel_mode == CHAFA_PIXEL_MODE_KITTY);
+    pthread_mutex_unlock(&rendererMutex);
+    return kitty;
 }
 
-int getCoverColor(FIBITMAP *bitmap, unsigned char **r, unsigned char **g, unsigned char **b)
+/* Ids are shared by everything running in the terminal window, the process id keeps ours apart */
+unsigned int newKittyImageId()
 {
-    int rwidth = FreeImage_GetWidth(bitmap);
-    int rheight = FreeImage_GetHeight(bitmap);
-    int rchannels = FreeImage_GetBPP(bitmap) / 8;
-    unsigned char *read_data = (unsigned char *)FreeImage_GetBits(bitmap);
+    pthread_mutex_lock(&rendererMutex);
+    if (renderer.kitty_next_id == 0)
+        renderer.kitty_next_id = ((unsigned int)getpid() & 0xffff) << 16;
+    if (++renderer.kitty_next_id == 0)
+        renderer.kitty_next_id = 1;
+    unsigned int id = renderer.kitty_next_id;
+    pthread_mutex_unlock(&rendererMutex);
+    return id;
+}
 
-    if (read_data == NULL)
+static gboolean
+write_all(const char *data, size_t length)
+{
+    while (length > 0)
     {
-        return -1;
+        ssize_t written = write(STDOUT_FILENO, data, length);
+        if (written <= 0)
+            return FALSE;
+        data += written;
+        length -= written;
     }
+    return TRUE;
+}
 
-    bool found = false;
-    int numPixels = rwidth * rheight;
-    *r = (unsigned char *)malloc(sizeof(unsigned char));
-    *g = (unsigned char *)malloc(sizeof(unsigned char));
-    *b = (unsigned char *)malloc(sizeof(unsigned char));
+/* The caller holds rendererMutex */
+static void
+write_kitty_deletes(void)
+{
+    char command[64];
 
-    for (int i = 0; i < numPixels; i++)
+    for (int i = 0; i < renderer.kitty_num_deletes; i++)
     {
-        int index = i * rchannels;
-        unsigned char blue = 0;
-        unsigned char green = 0;
-        unsigned char red = 0;
+        int length = snprintf(command, sizeof(command), "\033_Ga=d,d=I,i=%u,q=2\033\\", renderer.kitty_deletes[i]);
+        write_all(command, length);
+    }
+    renderer.kitty_num_deletes = 0;
+}
+
+/* The image is dropped from the terminal the next time something is written to it. When too many
+ * are waiting the terminal is left to evict it, kitty frees images without placements when it runs short. */
+void forgetKittyImage(unsigned int image_id)
+{
+    pthread_mutex_lock(&rendererMutex);
+    if (image_id != 0 && renderer.kitty_num_deletes < KITTY_PENDING_DELETES)
+        renderer.kitty_deletes[renderer.kitty_num_deletes++] = image_id;
+    pthread_mutex_unlock(&rendererMutex);
+}
 
-        if (rchannels >= 3)
+/* Kitty wants RGBA from the top row down, the bitmap is BGRA and already flipped */
+static void
+copy_rgba(FIBITMAP *bitmap, unsigned char *out)
+{
+    int pix_width = FreeImage_GetWidth(bitmap);
+    int pix_height = FreeImage_GetHeight(bitmap);
+    int pitch = FreeImage_GetPitch(bitmap);
+    const unsigned char *bits = FreeImage_GetBits(bitmap);
+
+    for (int y = 0; y < pix_height; y++)
+    {
+        const unsigned char *row = bits + (size_t)y * pitch;
+        for (int x = 0; x < pix_width; x++, out += 4)
         {
-            blue = read_data[index + 0];
-            green = read_data[index + 1];
-            red = read_data[index + 2];
+            out[0] = row[x * 4 + 2];
+            out[1] = row[x * 4 + 1];
+            out[2] = row[x * 4];
+            out[3] = row[x * 4 + 3];
         }
-        else if (rchannels >= 1)
+    }
+}
+
+/* Shared memory only works when kitty runs on this machine, other terminals get the pixels inline */
+static gboolean
+can_share_memory(void)
+{
+    return getenv("KITTY_WINDOW_ID") != NULL && getenv("SSH_CONNECTION") == NULL && getenv("SSH_TTY") == NULL;
+}
+
+static void
+get_kitty_shared_name(char *name, size_t size, unsigned int image_id)
+{
+    snprintf(name, size, "/cue-tty-graphics-protocol-%d-%u", (int)getpid(), image_id);
+}
+
+/* Kitty unlinks the object once it has read it, those it hasn't read after a while, or at exit, are unlinked here.
+ * The caller holds rendererMutex. */
+static void
+unlink_kitty_shared(gboolean all)
+{
+#ifndef G_OS_WIN32
+    char name[64];
+    gint64 now = g_get_monotonic_time();
+    int kept = 0;
+
+    for (int i = 0; i < renderer.kitty_num_shared; i++)
+    {
+        if (all || now - renderer.kitty_shared_times[i] >= KITTY_SHARED_TIMEOUT_US)
         {
-            blue = green = red = read_data[index];
+            get_kitty_shared_name(name, sizeof(name), renderer.kitty_shared[i]);
+            shm_unlink(name);
+            continue;
         }
+        renderer.kitty_shared[kept] = renderer.kitty_shared[i];
+        renderer.kitty_shared_times[kept] = renderer.kitty_shared_times[i];
+        kept++;
+    }
+    renderer.kitty_num_shared = kept;
+#else
+    (void)all;
+#endif
+}
+
+static gboolean
+send_kitty_shared(FIBITMAP *bitmap, unsigned int image_id)
+{
+#ifdef G_OS_WIN32
+    (void)bitmap;
+    (void)image_id;
+    return FALSE;
+#else
+    char name[64];
+    int pix_width = FreeImage_GetWidth(bitmap);
+    int pix_height = FreeImage_GetHeight(bitmap);
+    size_t size = (size_t)pix_width * pix_height * 4;
 
-        checkIfBrightPixel(red, green, blue, &found);
+    get_kitty_shared_name(name, sizeof(name), image_id);
 
-        if (found)
+    /* An id whose upload is still waiting is about to be reused, the old object goes first */
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return FALSE;
+
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return FALSE;
+    }
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return FALSE;
+    }
+    copy_rgba(bitmap, memory);
+    munmap(memory, size);
+
+    gchar *encoded = g_base64_encode((const guchar *)name, strlen(name));
+    GString *command = g_string_new(NULL);
+    g_string_printf(command, "\033_Ga=t,t=s,f=32,s=%d,v=%d,S=%zu,i=%u,q=2;%s\033\\", pix_width, pix_height, size, image_id, encoded);
+    gboolean sent = write_all(command->str, command->len);
+    g_string_free(command, TRUE);
+    g_free(encoded);
+
+    if (!sent)
+    {
+        shm_unlink(name);
+        return FALSE;
+    }
+
+    int slot = 0;
+    while (slot < renderer.kitty_num_shared && renderer.kitty_shared[slot] != image_id)
+        slot++;
+    if (slot == KITTY_PENDING_SHARED)
+    {
+        unlink_kitty_shared(TRUE);
+        slot = 0;
+    }
+    if (slot == renderer.kitty_num_shared)
+        renderer.kitty_num_shared++;
+    renderer.kitty_shared[slot] = image_id;
+    renderer.kitty_shared_times[slot] = g_get_monotonic_time();
+    return TRUE;
+#endif
+}
+
+static void
+send_kitty_direct(FIBITMAP *bitmap, unsigned int image_id)
+{
+    int pix_width = FreeImage_GetWidth(bitmap);
+    int pix_height = FreeImage_GetHeight(bitmap);
+    size_t size = (size_t)pix_width * pix_height * 4;
+
+    unsigned char *rgba = malloc(size);
+    if (rgba == NULL)
+        return;
+    copy_rgba(bitmap, rgba);
+    gchar *encoded = g_base64_encode(rgba, size);
+    free(rgba);
+
+    /* The payload goes out in chunks, the last one has m=0 */
+    size_t length = strlen(encoded);
+    size_t offset = 0;
+    GString *command = g_string_sized_new(length + (length / KITTY_CHUNK_SIZE + 1) * 16 + 64);
+    do
+    {
+        size_t chunk = MIN(length - offset, KITTY_CHUNK_SIZE);
+        int more = (offset + chunk < length);
+
+        if (offset == 0)
+            g_string_append_printf(command, "\033_Ga=t,f=32,s=%d,v=%d,i=%u,q=2,m=%d;", pix_width, pix_height, image_id, more);
+        else
+            g_string_append_printf(command, "\033_Gm=%d;", more);
+        g_string_append_len(command, encoded + offset, chunk);
+        g_string_append(command, "\033\\");
+        offset += chunk;
+    } while (offset < length);
+
+    write_all(command->str, command->len);
+    g_string_free(command, TRUE);
+    g_free(encoded);
+}
+
+/* Uploads a 32 bit bitmap under image_id, an image already stored under that id is replaced */
+void sendKittyImage(FIBITMAP *bitmap, unsigned int image_id)
+{
+    if (bitmap == NULL || image_id == 0 || FreeImage_GetBPP(bitmap) != 32)
+        return;
+
+    pthread_mutex_lock(&rendererMutex);
+    write_kitty_deletes();
+    unlink_kitty_shared(FALSE);
+    if (!can_share_memory() || !send_kitty_shared(bitmap, image_id))
+        send_kitty_direct(bitmap, image_id);
+    pthread_mutex_unlock(&rendererMutex);
+}
+
+/* Shows an uploaded image in a box of width x height cells the way printBitmapCentered() would,
+ * the cursor ends up on the last line of the box */
+GString *renderKittyPlacement(unsigned int image_id, int pix_width, int pix_height, int width, int height)
+{
+    TermSize term_size;
+    gint cell_width = 8, cell_height = 16;
+
+    if (image_id == 0 || pix_width <= 0 || pix_height <= 0 || width <= 0 || height <= 0)
+        return NULL;
+
+    get_cached_tty_size(&term_size);
+
+    if (term_size.width_cells > 0 && term_size.height_cells > 0 && term_size.width_pixels > 0 && term_size.height_pixels > 0)
+    {
+        cell_width = term_size.width_pixels / term_size.width_cells;
+        cell_height = term_size.height_pixels / term_size.height_cells;
+    }
+
+    /* Kitty stretches the image over the columns and rows it is given, so they keep its aspect ratio */
+    gint columns = width;
+    gint rows = (gint)((double)pix_height * columns * cell_width / ((double)pix_width * cell_height) + 0.5);
+    if (rows > height)
+    {
+        rows = height;
+        columns = (gint)((double)pix_width * rows * cell_height / ((double)pix_height * cell_width) + 0.5);
+    }
+    columns = CLAMP(columns, 1, width);
+    rows = CLAMP(rows, 1, height);
+
+    int indentation = ((term_size.width_cells - columns) / 2) + 1;
+    if (indentation < 0)
+        indentation = 0;
+
+    GString *placement = g_string_sized_new(128 + indentation + height);
+
+    /* Other covers placed earlier are taken off the screen, their images stay in the terminal */
+    g_string_append(placement, "\033_Ga=d,d=a,q=2\033\\");
+    g_string_append_printf(placement, "\n%*s\033_Ga=p,i=%u,p=1,c=%d,r=%d,C=1,q=2\033\\", indentation, "", image_id, columns, rows);
+    for (int i = 1; i < height; i++)
+        g_string_append_c(placement, '\n');
+
+    return placement;
+}
+
+typedef struct
+{
+    unsigned int count;
+    unsigned int r, g, b;
+} PaletteBin;
+
+/* The most common bright colours of a cover, colourful ones count for more than greys.
+ * A grid of at most PALETTE_SAMPLES x PALETTE_SAMPLES pixels is sorted into bins of 4 bits per channel. */
+CoverPalette getCoverPalette(FIBITMAP *bitmap)
+{
+    CoverPalette palette = {{{210, 210, 210}}, 0};
+
+    if (bitmap == NULL)
+        return palette;
+
+    int width = FreeImage_GetWidth(bitmap);
+    int height = FreeImage_GetHeight(bitmap);
+    int channels = FreeImage_GetBPP(bitmap) / 8;
+    int pitch = FreeImage_GetPitch(bitmap);
+    const unsigned char *bits = FreeImage_GetBits(bitmap);
+
+    if (bits == NULL || channels < 3)
+        return palette;
+
+    PaletteBin *bins = calloc(PALETTE_BINS, sizeof(PaletteBin));
+    if (bins == NULL)
+        return palette;
+
+    int step_x = width > PALETTE_SAMPLES ? width / PALETTE_SAMPLES : 1;
+    int step_y = height > PALETTE_SAMPLES ? height / PALETTE_SAMPLES : 1;
+
+    for (int y = 0; y < height; y += step_y)
+    {
+        const unsigned char *row = bits + (size_t)y * pitch;
+        for (int x = 0; x < width; x += step_x)
         {
-            *(*r) = red;
-            *(*g) = green;
-            *(*b) = blue;
-            break;
+            unsigned int b = row[x * channels];
+            unsigned int g = row[x * channels + 1];
+            unsigned int r = row[x * channels + 2];
+
+            /* Too dark to be read as text, or plain white */
+            if (((54 * r + 183 * g + 19 * b) >> 8) <= 100 || (r == 255 && g == 255 && b == 255))
+                continue;
+
+            PaletteBin *bin = &bins[(r >> 4) << 8 | (g >> 4) << 4 | (b >> 4)];
+            bin->count++;
+            bin->r += r;
+            bin->g += g;
+            bin->b += b;
         }
     }
 
-    if (!found)
+    while (palette.count < COVER_PALETTE_SIZE)
     {
-        *(*r) = 210;
-        *(*g) = 210;
-        *(*b) = 210;
+        PixelData best_color = {0, 0, 0};
+        unsigned long best_weight = 0;
+        int best = -1;
+
+        for (int i = 0; i < PALETTE_BINS; i++)
+        {
+            if (bins[i].count == 0)
+                continue;
+
+            PixelData color = {bins[i].r / bins[i].count, bins[i].g / bins[i].count, bins[i].b / bins[i].count};
+            int max = color.r > color.g ? (color.r > color.b ? color.r : color.b) : (color.g > color.b ? color.g : color.b);
+            int min = color.r < color.g ? (color.r < color.b ? color.r : color.b) : (color.g < color.b ? color.g : color.b);
+            unsigned long weight = (unsigned long)bins[i].count * (max - min + 32);
+
+            /* Leave out colours close to ones already picked */
+            bool close = false;
+            for (int j = 0; j < palette.count && !close; j++)
+            {
+                const PixelData *picked = &palette.colors[j];
+                close = abs(picked->r - color.r) + abs(picked->g - color.g) + abs(picked->b - color.b) < 96;
+            }
+            if (close)
+            {
+                bins[i].count = 0;
+                continue;
+            }
+
+            if (weight > best_weight)
+            {
+                best_weight = weight;
+                best_color = color;
+                best = i;
+            }
+        }
+
+        if (best < 0)
+            break;
+
+        palette.colors[palette.count++] = best_color;
+        bins[best].count = 0;
     }
-    return 0;
-}
\ No newline at end of file
+
+    free(bins);
+    return palette;
+}
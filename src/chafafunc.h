@@ -1,3 +1,5 @@
+#ifndef CHAFAFUNC_H
+#define CHAFAFUNC_H
 #include <chafa.h>
 #include <chafa-canvas-config.h>
 #include <stdio.h>
@@ -5,10 +7,35 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
 #include <FreeImage.h>
+#include "../include/imgtotxt/write_ascii.h"
+
+#define COVER_PALETTE_SIZE 4
+#define PALETTE_SAMPLES 64
+#define PALETTE_BINS 4096
+
+typedef struct
+{
+    PixelData colors[COVER_PALETTE_SIZE]; // The accent colour first, 210, 210, 210 when there are none
+    int count;
+} CoverPalette;
 
 void printImage(const char *image_path, int width, int height);
 FIBITMAP *getBitmap(const char *image_path);
+FIBITMAP *getBitmapFromMemory(unsigned char *data, int size);
 void printBitmap(FIBITMAP *bitmap, int width, int height);
 void printBitmapCentered(FIBITMAP *bitmap, int width, int height);
-int getCoverColor(FIBITMAP *bitmap, unsigned char **r, unsigned char **g, unsigned char **b);
\ No newline at end of file
+GString *renderBitmapCentered(FIBITMAP *bitmap, int width, int height);
+void calcScaledSize(FIBITMAP *bitmap, int width, int height, int *scaled_width, int *scaled_height);
+void invalidateTermSize();
+void freeRenderer();
+bool useKittyGraphics();
+unsigned int newKittyImageId();
+void forgetKittyImage(unsigned int image_id);
+void sendKittyImage(FIBITMAP *bitmap, unsigned int image_id);
+GString *renderKittyPlacement(unsigned int image_id, int pix_width, int pix_height, int width, int height);
+CoverPalette getCoverPalette(FIBITMAP *bitmap);
+
+#endif
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "covercache.h"
+#include "albumart.h"
+#include "chafafunc.h"
+#include "file.h"
+#include "folderart.h"
+
+/*
+Covers are decoded once and kept in a short most recently used list, so the songs of an album share one bitmap.
+Embedded pictures are keyed by a hash of their bytes and folder art by the directory, which is only used for
+songs without a picture of their own. Covers larger than COVER_THUMBNAIL_SIZE are scaled down after decoding
+and the result is saved in a thumbnail directory, later runs load that instead.
+*/
+
+static CoverArt *covers = NULL; // Most recently used first
+static pthread_mutex_t coverMutex = PTHREAD_MUTEX_INITIALIZER;
+static char thumbnailDirectory[MAXPATHLEN]; // Empty when it couldn't be created
+static pthread_once_t thumbnailDirectoryOnce = PTHREAD_ONCE_INIT;
+
+uint64_t hashCoverBytes(uint64_t hash, const void *data, size_t size)
+{
+    // FNV-1a
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+int createThumbnailDirectory(char *path)
+{
+    char base[MAXPATHLEN];
+    const char *cacheHome = getenv("XDG_CACHE_HOME");
+
+    if (cacheHome != NULL && cacheHome[0] != '\0')
+    {
+        snprintf(base, sizeof(base), "%s", cacheHome);
+    }
+    else
+    {
+        struct passwd *pw = getpwuid(getuid());
+        if (pw == NULL)
+            return -1;
+        snprintf(base, sizeof(base), "%s/.cache", pw->pw_dir);
+    }
+
+    if (strlen(base) + strlen("/cue/covers") >= MAXPATHLEN || createDirectory(base) < 0)
+        return -1;
+
+    strcpy(path, base);
+    strcat(path, "/cue");
+    if (createDirectory(path) < 0)
+        return -1;
+
+    strcat(path, "/covers");
+    return (createDirectory(path) < 0) ? -1 : 0;
+}
+
+void initThumbnailDirectory()
+{
+    if (createThumbnailDirectory(thumbnailDirectory) < 0)
+        thumbnailDirectory[0] = '\0';
+}
+
+// Created the first time a thumbnail is looked for, NULL when that failed
+const char *getThumbnailDirectory()
+{
+    pthread_once(&thumbnailDirectoryOnce, initThumbnailDirectory);
+    return (thumbnailDirectory[0] != '\0') ? thumbnailDirectory : NULL;
+}
+
+FIBITMAP *loadThumbnail(uint64_t id, char *thumbnailPath)
+{
+    const char *directory = getThumbnailDirectory();
+
+    thumbnailPath[0] = '\0';
+    if (directory == NULL || strlen(directory) + 22 >= MAXPATHLEN)
+        return NULL;
+
+    snprintf(thumbnailPath, MAXPATHLEN, "%s/%016llx.png", directory, (unsigned long long)id);
+    if (!existsFile(thumbnailPath))
+        return NULL;
+
+    FreeImage_Initialise(false);
+    FIBITMAP *image = FreeImage_Load(FIF_PNG, thumbnailPath, 0);
+    if (image == NULL || FreeImage_GetBPP(image) == 32)
+        return image;
+
+    FIBITMAP *bitmap = FreeImage_ConvertTo32Bits(image);
+    FreeImage_Unload(image);
+    return bitmap;
+}
+
+// Thumbnails are stored the way they are kept in memory, already flipped
+void saveThumbnail(FIBITMAP *bitmap, const char *thumbnailPath)
+{
+    char tempPath[MAXPATHLEN];
+
+    if (thumbnailPath[0] == '\0' || strlen(thumbnailPath) + 16 >= MAXPATHLEN)
+        return;
+
+    snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", thumbnailPath, (int)getpid());
+    if (FreeImage_Save(FIF_PNG, bitmap, tempPath, 0) && rename(tempPath, thumbnailPath) == 0)
+        return;
+
+    unlink(tempPath);
+}
+
+FIBITMAP *decodeCover(CoverArt *cover, uint64_t id)
+{
+    char thumbnailPath[MAXPATHLEN];
+
+    FIBITMAP *bitmap = loadThumbnail(id, thumbnailPath);
+    if (bitmap != NULL)
+        return bitmap;
+
+    if (cover->data != NULL)
+        bitmap = getBitmapFromMemory(cover->data, cover->dataSize);
+    else
+        bitmap = getBitmap(cover->path);
+
+    if (bitmap == NULL)
+        return NULL;
+
+    int width = FreeImage_GetWidth(bitmap);
+    int height = FreeImage_GetHeight(bitmap);
+
+    if (width > COVER_THUMBNAIL_SIZE || height > COVER_THUMBNAIL_SIZE)
+    {
+        double scale = (double)COVER_THUMBNAIL_SIZE / (width > height ? width : height);
+        int thumbnailWidth = (int)(width * scale) > 0 ? (int)(width * scale) : 1;
+        int thumbnailHeight = (int)(height * scale) > 0 ? (int)(height * scale) : 1;
+
+        FIBITMAP *thumbnail = FreeImage_Rescale(bitmap, thumbnailWidth, thumbnailHeight, FILTER_BILINEAR);
+        if (thumbnail != NULL)
+        {
+            FreeImage_Unload(bitmap);
+            bitmap = thumbnail;
+            saveThumbnail(bitmap, thumbnailPath);
+        }
+    }
+
+    return bitmap;
+}
+
+void freeCoverArt(CoverArt *cover)
+{
+    for (int i = 0; i < COVER_SCALED_VARIANTS; i++)
+    {
+        if (cover->scaled[i].bitmap != NULL)
+            FreeImage_Unload(cover->scaled[i].bitmap);
+    }
+    for (int i = 0; i < COVER_RENDERED_VARIANTS; i++)
+        free(cover->rendered[i].output);
+    if (cover->bitmap != NULL)
+        FreeImage_Unload(cover->bitmap);
+    if (cover->kittyWidth > 0)
+        forgetKittyImage(cover->kittyImage);
+    free(cover->data);
+    free(cover);
+}
+
+// Takes a reference, the caller holds coverMutex
+CoverArt *findCover(const char *key)
+{
+    CoverArt *previous = NULL;
+
+    for (CoverArt *cover = covers; cover != NULL; previous = cover, cover = cover->next)
+    {
+        if (strcmp(cover->key, key) != 0)
+            continue;
+
+        if (previous != NULL)
+        {
+            previous->next = cover->next;
+            cover->next = covers;
+            covers = cover;
+        }
+        cover->refs++;
+        return cover;
+    }
+    return NULL;
+}
+
+CoverArt *lookupCover(const char *key)
+{
+    pthread_mutex_lock(&coverMutex);
+    CoverArt *cover = findCover(key);
+    pthread_mutex_unlock(&coverMutex);
+    return cover;
+}
+
+// Decoding happens outside the lock, so another thread may have added the same cover in the meantime
+CoverArt *insertCover(CoverArt *cover)
+{
+    pthread_mutex_lock(&coverMutex);
+
+    CoverArt *existing = findCover(cover->key);
+    if (existing != NULL)
+    {
+        pthread_mutex_unlock(&coverMutex);
+        freeCoverArt(cover);
+        return existing;
+    }
+
+    cover->refs = 1;
+    cover->next = covers;
+    covers = cover;
+
+    // Drop the least recently used covers that no song refers to anymore
+    int count = 0;
+    CoverArt **link = &covers;
+    while (*link != NULL)
+    {
+        CoverArt *current = *link;
+        if (++count > COVER_CACHE_SIZE && current->refs == 0)
+        {
+            *link = current->next;
+            freeCoverArt(current);
+            continue;
+        }
+        link = &current->next;
+    }
+
+    pthread_mutex_unlock(&coverMutex);
+    return cover;
+}
+
+CoverArt *newCoverArt(const char *key)
+{
+    CoverArt *cover = calloc(1, sizeof(CoverArt));
+    if (cover != NULL)
+        snprintf(cover->key, sizeof(cover->key), "%s", key);
+    return cover;
+}
+
+CoverArt *acquireFolderCover(const char *directory)
+{
+    CoverArt *cover = lookupCover(directory);
+    if (cover != NULL)
+        return cover;
+
+    cover = newCoverArt(directory);
+    if (cover == NULL)
+        return NULL;
+
+    const char *image = findFolderCover(directory);
+
+    if (image != NULL)
+    {
+        struct stat fileStats;
+
+        snprintf(cover->path, sizeof(cover->path), "%s", image);
+
+        // A replaced image gets a thumbnail of its own
+        uint64_t id = hashCoverBytes(14695981039346656037ull, cover->path, strlen(cover->path));
+        if (stat(cover->path, &fileStats) == 0)
+        {
+            id = hashCoverBytes(id, &fileStats.st_mtime, sizeof(fileStats.st_mtime));
+            id = hashCoverBytes(id, &fileStats.st_size, sizeof(fileStats.st_size));
+        }
+        cover->bitmap = decodeCover(cover, id);
+    }
+
+    cover->palette = getCoverPalette(cover->bitmap);
+    return insertCover(cover);
+}
+
+CoverArt *acquireCover(const char *filePath)
+{
+    char key[MAXPATHLEN];
+    char directory[MAXPATHLEN];
+    unsigned char *data = NULL;
+    int size = 0;
+
+    if (filePath == NULL || filePath[0] == '\0')
+        return NULL;
+
+    getDirectoryFromPath(filePath, directory);
+
+    // The songs of an album usually have the same picture, it is only decoded for the first of them
+    if (extractEmbeddedCover(filePath, &data, &size) != 0)
+        return acquireFolderCover(directory);
+
+    uint64_t id = hashCoverBytes(14695981039346656037ull, data, size);
+    snprintf(key, sizeof(key), "#%016llx-%d", (unsigned long long)id, size);
+
+    CoverArt *cover = lookupCover(key);
+    if (cover != NULL)
+    {
+        free(data);
+        return cover;
+    }
+
+    cover = newCoverArt(key);
+    if (cover == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+
+    cover->data = data;
+    cover->dataSize = size;
+    cover->bitmap = decodeCover(cover, id);
+
+    if (cover->bitmap == NULL)
+    {
+        freeCoverArt(cover);
+        return acquireFolderCover(directory);
+    }
+
+    cover->palette = getCoverPalette(cover->bitmap);
+    return insertCover(cover);
+}
+
+void releaseCover(CoverArt *cover)
+{
+    if (cover == NULL)
+        return;
+
+    pthread_mutex_lock(&coverMutex);
+    cover->refs--;
+    pthread_mutex_unlock(&coverMutex);
+}
+
+// The bitmap resized to exactly width x height pixels. Resized copies are kept per size, so a result stays
+// valid until COVER_SCALED_VARIANTS other sizes have been asked for. renderCover() serialises the callers.
+FIBITMAP *getResizedCover(CoverArt *cover, int width, int height)
+{
+    if (cover == NULL || cover->bitmap == NULL || width <= 0 || height <= 0)
+        return NULL;
+
+    if ((int)FreeImage_GetWidth(cover->bitmap) == width && (int)FreeImage_GetHeight(cover->bitmap) == height)
+        return cover->bitmap;
+
+    pthread_mutex_lock(&coverMutex);
+
+    ScaledCover *slot = &cover->scaled[0];
+    for (int i = 0; i < COVER_SCALED_VARIANTS; i++)
+    {
+        ScaledCover *scaled = &cover->scaled[i];
+
+        if (scaled->bitmap != NULL && scaled->width == width && scaled->height == height)
+        {
+            scaled->lastUsed = ++cover->scaledUses;
+            pthread_mutex_unlock(&coverMutex);
+            return scaled->bitmap;
+        }
+
+        if (slot->bitmap != NULL && (scaled->bitmap == NULL || scaled->lastUsed < slot->lastUsed))
+            slot = scaled;
+    }
+
+    FIBITMAP *bitmap = FreeImage_Rescale(cover->bitmap, width, height, FILTER_BILINEAR);
+    if (bitmap != NULL)
+    {
+        if (slot->bitmap != NULL)
+            FreeImage_Unload(slot->bitmap);
+        slot->bitmap = bitmap;
+        slot->width = width;
+        slot->height = height;
+        slot->lastUsed = ++cover->scaledUses;
+    }
+
+    pthread_mutex_unlock(&coverMutex);
+    return bitmap;
+}
+
+// Scaled down to what a canvas of width x height cells can show
+FIBITMAP *getScaledCover(CoverArt *cover, int width, int height)
+{
+    int scaledWidth, scaledHeight;
+
+    if (cover == NULL || cover->bitmap == NULL)
+        return NULL;
+
+    calcScaledSize(cover->bitmap, width, height, &scaledWidth, &scaledHeight);
+    FIBITMAP *scaled = getResizedCover(cover, scaledWidth, scaledHeight);
+    return (scaled != NULL) ? scaled : cover->bitmap;
+}
+
+void freeCoverCache()
+{
+    pthread_mutex_lock(&coverMutex);
+    while (covers != NULL)
+    {
+        CoverArt *next = covers->next;
+        freeCoverArt(covers);
+        covers = next;
+    }
+    pthread_mutex_unlock(&coverMutex);
+}
@@ -0,0 +1,63 @@
+#ifndef COVERCACHE_H
+#define COVERCACHE_H
+#include <stdbool.h>
+#include <sys/param.h>
+#include <FreeImage.h>
+#include "chafafunc.h"
+
+#define COVER_CACHE_SIZE 8
+#define COVER_THUMBNAIL_SIZE 1024
+#define COVER_SCALED_VARIANTS 4
+#define COVER_RENDERED_VARIANTS 3
+
+typedef struct
+{
+    FIBITMAP *bitmap;
+    int width;
+    int height;
+    unsigned int lastUsed;
+} ScaledCover;
+
+// Terminal output ready to be written, see getRenderedCover() in albumart.c
+typedef struct
+{
+    char *output;
+    size_t length;
+    int width;
+    int height;
+    int termWidth;
+    bool ascii;
+    unsigned int lastUsed;
+} RenderedCover;
+
+// A decoded cover shared by all the songs of an album, get it with acquireCover() and give it back with releaseCover()
+typedef struct CoverArt
+{
+    char key[MAXPATHLEN];
+    char path[MAXPATHLEN];     // The image file when the cover came from the folder, empty otherwise
+    unsigned char *data;       // The encoded picture when it was embedded in the file
+    int dataSize;
+    FIBITMAP *bitmap;          // NULL when the song has no cover, so the folder isn't searched again
+    CoverPalette palette;      // Computed once, on the loader thread
+    ScaledCover scaled[COVER_SCALED_VARIANTS];
+    unsigned int scaledUses;
+    RenderedCover rendered[COVER_RENDERED_VARIANTS];
+    unsigned int renderedUses;
+    unsigned int kittyImage;   // Id of the image in a kitty terminal, 0 until one was given out
+    int kittyWidth;            // Size of the upload, 0 until the image was sent
+    int kittyHeight;
+    int refs;
+    struct CoverArt *next;
+} CoverArt;
+
+CoverArt *acquireCover(const char *filePath);
+
+void releaseCover(CoverArt *cover);
+
+FIBITMAP *getResizedCover(CoverArt *cover, int width, int height);
+
+FIBITMAP *getScaledCover(CoverArt *cover, int width, int height);
+
+void freeCoverCache();
+
+#endif
@@ -47,6 +47,9 @@ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
 #include "player.h"
 #include "cache.h"
 #include "songloader.h"
+#include "stringpool.h"
+#include "covercache.h"
+#include "folderart.h"
 
 #ifndef CLOCK_MONOTONIC
 #define CLOCK_MONOTONIC 1
@@ -67,6 +70,7 @@ bool usingSongDataA = true;
 bool loadingFailed = false;
 bool skipPrev = false;
 bool skipping = false;
+bool songEnded = false;
 
 struct timespec current_time;
 struct timespec start_time;
@@ -211,12 +215,8 @@ void cleanup()
 
 void doShuffle()
 {
-    stopPlayListDurationCount();
-    usleep(100000);
-    playlist.totalDuration = 0.0;
+    // Only the order changes, so the playlist duration stays valid
     shufflePlaylistStartingFromSong(&playlist, currentSong);
-    calculatePlayListDuration(&playlist);
-    usleep(100000);
     loadedNextSong = false;
     refresh = true;
     nextSong = NULL;
@@ -224,12 +224,12 @@ void doShuffle()
 
 void addToPlaylist()
 {
-    if (!playingMainPlaylist)
-    {
-        SongInfo song;
-        song.filePath = strdup(currentSong->song.filePath);
-        addToList(mainPlaylist, song);
-    }
+    addToMainPlaylist(currentSong->song);
+}
+
+void deleteFromPlaylist()
+{
+    removeFromMainPlaylist(currentSong->song);
 }
 
 void toggleBlocks()
@@ -256,7 +256,9 @@ void toggleVisualizer()
 {
     visualizerEnabled = !visualizerEnabled;
     strcpy(settings.visualizerEnabled, visualizerEnabled ? "1" : "0");
+    pthread_mutex_lock(&outputMutex);
     restoreCursorPosition();
+    pthread_mutex_unlock(&outputMutex);
     refresh = true;
 }
 
@@ -274,15 +276,6 @@ void quit()
     doQuit = true;
 }
 
-void freeAudioBuffer()
-{
-    if (g_audioBuffer != NULL)
-    {
-        free(g_audioBuffer);
-        g_audioBuffer = NULL;
-    }
-}
-
 void assignLoadedData()
 {
     if (usingSongDataA)
@@ -319,6 +312,8 @@ void *songDataReaderThread(void *arg)
     else
         songdata = NULL;
 
+    prerenderCover(songdata);
+
     if (loadingdata->loadA)
     {
         unloadSongData(&loadingdata->songdataA);
@@ -353,7 +348,7 @@ void loadSong(Node *song, LoadingThreadData *loadingdata)
         return;
     }
 
-    strcpy(loadingdata->filePath, song->song.filePath);
+    getSongPath(&song->song, loadingdata->filePath, sizeof(loadingdata->filePath));
 
     pthread_t loadingThread;
     pthread_create(&loadingThread, NULL, songDataReaderThread, (void *)loadingdata);
@@ -361,7 +356,7 @@ void loadSong(Node *song, LoadingThreadData *loadingdata)
 
 void loadNext(LoadingThreadData *loadingdata)
 {
-    nextSong = getListNext(currentSong);
+    nextSong = drawPlayListNext(&playlist, currentSong);
 
     if (nextSong == NULL)
     {
@@ -369,7 +364,7 @@ void loadNext(LoadingThreadData *loadingdata)
     }
     else
     {
-        strcpy(loadingdata->filePath, nextSong->song.filePath);
+        getSongPath(&nextSong->song, loadingdata->filePath, sizeof(loadingdata->filePath));
     }
 
     pthread_t loadingThread;
@@ -392,7 +387,7 @@ void prepareNextSong()
         return;
 
     if (!skipPrev && !repeatEnabled)
-        currentSong = currentSong->next;
+        currentSong = drawPlayListNext(&playlist, currentSong);
     else
         skipPrev = false;
 
@@ -432,7 +427,7 @@ void prepareNextSong()
 
 void skipToNextSong()
 {
-    if (currentSong->next == NULL)
+    if (drawPlayListNext(&playlist, currentSong) == NULL)
     {
         return;
     }
@@ -446,7 +441,7 @@ void skipToNextSong()
 
 void skipToPrevSong()
 {
-    if (currentSong->prev == NULL)
+    if (getPlayListPrev(&playlist, currentSong) == NULL)
     {
         return;
     }
@@ -459,7 +454,7 @@ void skipToPrevSong()
     loadedNextSong = false;
     songLoading = true;
 
-    currentSong = currentSong->prev;
+    currentSong = getPlayListPrev(&playlist, currentSong);
     if (usingSongDataA)
     {
         loadingdata.loadA = false;
@@ -508,6 +503,10 @@ void loadAudioData()
 {
     if (nextSong == NULL && !songLoading)
     {
+        // Until the scan finds another song, this is tried again on the next tick
+        if (drawPlayListNext(&playlist, currentSong) == NULL && isPlayListNextPending(&playlist, currentSong))
+            return;
+
         songLoading = true;
         loadingdata.loadA = !usingSongDataA;
         loadNext(&loadingdata);
@@ -557,7 +556,7 @@ void handleInput()
         addToPlaylist();
         break;
     case EVENT_DELETEFROMMAINPLAYLIST:
-        // FIXME implement this
+        deleteFromPlaylist();
         break;
     case EVENT_EXPORTPLAYLIST:
         savePlaylist();
@@ -578,6 +577,7 @@ void resize()
         usleep(100000);
     }
     alarm(0); // Cancel timer
+    invalidateTermSize();
     refresh = true;
     printf("\033[1;1H");
     clearRestOfScreen();
@@ -618,17 +618,31 @@ void play(Node *song)
     clock_gettime(CLOCK_MONOTONIC, &start_time);
     calculatePlayListDuration(&playlist);
 
+    startVisualizer();
+
     while (true)
     {
         calcElapsedTime();
         handleInput();
+
+        // Only drawing is shared with the visualizer thread. What a tick draws reaches the terminal in one go
+        // when endFrame() flushes it.
+        pthread_mutex_lock(&outputMutex);
+        beginFrame();
         updatePlayer();
+        endFrame();
+        pthread_mutex_unlock(&outputMutex);
 
         if (!loadedNextSong)
             loadAudioData();
 
         if (isPlaybackDone())
+            songEnded = true;
+
+        // The next song may not have been found by the scan yet
+        if (songEnded && (loadedNextSong || loadingFailed))
         {
+            songEnded = false;
             prepareNextSong();
         }
 
@@ -638,6 +652,9 @@ void play(Node *song)
         }
         usleep(100000);
     }
+
+    stopVisualizer();
+    flushOutput();
     return;
 }
 
@@ -650,19 +667,24 @@ int run()
         enableInputBuffering();
         return -1;
     }
-    currentSong = playlist.head;
+    currentSong = getPlayListFirst(&playlist);
     play(currentSong);
     cleanup();
     restoreTerminalMode();
     enableInputBuffering();
     setConfig();
-    saveMainPlaylist(settings.path, playingMainPlaylist);
-    freeAudioBuffer();
+    stopPlaylistProducer();
+    saveMainPlaylist();
     deleteCache(tempCache);
     deleteTempDir();
     deletePlaylist(&playlist);
     deletePlaylist(mainPlaylist);
     free(mainPlaylist);
+    freeCoverCache();
+    freeFolderCovers();
+    freeRenderer();
+    freeSpectrumAnalyzer();
+    freeStringPool();
     showCursor();
     printf("\n");
 
@@ -714,6 +736,9 @@ void playAll(int argc, char **argv)
 
 int main(int argc, char *argv[])
 {
+    // Before anything is written, the C standard only allows setvbuf() then
+    initOutputBuffer();
+
     getConfig();
     loadMainPlaylist(settings.path);
 
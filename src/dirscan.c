@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <regex.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "dirscan.h"
+#include "stringfunc.h"
+
+/*
+Scans a directory tree with a pool of threads. Every worker owns a deque of directories,
+it takes from its own end and steals from the other end of the others' deques when it runs dry.
+Directories are opened relative to their parent's descriptor and entry types come from
+getdents64, so a file is only stat'ed when the file system doesn't report its type.
+Every directory is identified by its device and inode once opened, a directory reached a second
+time through a symbolic link is left empty, so links pointing back up the tree don't repeat it.
+*/
+
+#define GETDENTS_BUFFER_SIZE 32768
+#define EXTENSION_LENGTH 5
+#define OPEN_RETRIES 100 // Waiting a millisecond each time, for other workers to close descriptors
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct
+{
+    ScanDir **tasks;
+    int head;
+    int tail;
+    int capacity;
+    pthread_mutex_t mutex;
+} ScanDeque;
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    bool used;
+} VisitedDir;
+
+typedef struct
+{
+    ScanDeque deques[MAX_SCAN_THREADS];
+    int numWorkers;
+    regex_t regex;
+    int pending;
+    int available;
+    ScanCallback callback;
+    void *callbackData;
+    bool cancelled;
+    VisitedDir *visited; // Open addressing on the inode
+    int visitedSize;
+    int numVisited;
+    pthread_mutex_t visitedMutex;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ScanState;
+
+typedef struct
+{
+    ScanState *state;
+    int id;
+} ScanWorker;
+
+ScanDir *newScanDir(ScanDir *parent, const char *name)
+{
+    ScanDir *dir = calloc(1, sizeof(ScanDir));
+    if (dir == NULL)
+        return NULL;
+
+    if (parent == NULL)
+    {
+        dir->path = strdup(name);
+    }
+    else
+    {
+        size_t length = strlen(parent->path) + strlen(name) + 2;
+        if (length > PATH_MAX)
+        {
+            free(dir);
+            return NULL;
+        }
+        dir->path = malloc(length);
+        if (dir->path != NULL)
+            snprintf(dir->path, length, "%s/%s", parent->path, name);
+    }
+    dir->name = strdup(name);
+    dir->parent = parent;
+    dir->fd = -1;
+    dir->refs = 1;
+
+    if (dir->path == NULL || dir->name == NULL)
+    {
+        free(dir->path);
+        free(dir->name);
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+void freeScanTree(ScanDir *dir)
+{
+    if (dir == NULL)
+        return;
+
+    for (int i = 0; i < dir->numEntries; i++)
+    {
+        freeScanTree(dir->entries[i].dir);
+        free(dir->entries[i].name);
+    }
+    free(dir->entries);
+    free(dir->path);
+    free(dir->name);
+    free(dir);
+}
+
+// The descriptor stays open until the directory itself and all its subdirectories have been opened
+void releaseScanDir(ScanDir *dir)
+{
+    if (dir != NULL && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0 && dir->fd >= 0)
+    {
+        close(dir->fd);
+        dir->fd = -1;
+    }
+}
+
+int addScanEntry(ScanDir *dir, const char *name, ScanDir *subDir)
+{
+    if (dir->numEntries == dir->capacity)
+    {
+        int capacity = dir->capacity > 0 ? dir->capacity * 2 : 16;
+        ScanEntry *entries = realloc(dir->entries, capacity * sizeof(ScanEntry));
+        if (entries == NULL)
+            return -1;
+        dir->entries = entries;
+        dir->capacity = capacity;
+    }
+    ScanEntry *entry = &dir->entries[dir->numEntries];
+    entry->name = strdup(name);
+    entry->dir = subDir;
+    if (entry->name == NULL)
+        return -1;
+    dir->numEntries++;
+    return 0;
+}
+
+// Same order as compare() in playlist.c: names starting with an underscore first
+int compareScanEntries(const void *a, const void *b)
+{
+    const char *nameA = ((const ScanEntry *)a)->name;
+    const char *nameB = ((const ScanEntry *)b)->name;
+
+    if (nameA[0] == '_' && nameB[0] != '_')
+        return -1;
+    else if (nameA[0] != '_' && nameB[0] == '_')
+        return 1;
+
+    return strcmp(nameA, nameB);
+}
+
+// Fails only when the deque can't grow, the caller then scans the directory itself
+int pushScanDir(ScanState *state, int id, ScanDir *dir)
+{
+    ScanDeque *deque = &state->deques[id];
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->tail == deque->capacity)
+    {
+        if (deque->head > 0)
+        {
+            memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(ScanDir *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        else
+        {
+            int capacity = deque->capacity > 0 ? deque->capacity * 2 : 64;
+            ScanDir **tasks = realloc(deque->tasks, capacity * sizeof(ScanDir *));
+            if (tasks == NULL)
+            {
+                pthread_mutex_unlock(&deque->mutex);
+                return -1;
+            }
+            deque->tasks = tasks;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->tail++] = dir;
+    pthread_mutex_unlock(&deque->mutex);
+
+    pthread_mutex_lock(&state->mutex);
+    state->available++;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->mutex);
+    return 0;
+}
+
+ScanDir *takeScanDir(ScanState *state, int id)
+{
+    ScanDir *dir = NULL;
+
+    for (int i = 0; i < state->numWorkers && dir == NULL; i++)
+    {
+        int victim = (id + i) % state->numWorkers;
+        ScanDeque *deque = &state->deques[victim];
+
+        pthread_mutex_lock(&deque->mutex);
+        if (deque->tail > deque->head)
+        {
+            // Depth first from our own deque, breadth first when stealing
+            if (victim == id)
+                dir = deque->tasks[--deque->tail];
+            else
+                dir = deque->tasks[deque->head++];
+        }
+        pthread_mutex_unlock(&deque->mutex);
+    }
+
+    if (dir != NULL)
+    {
+        pthread_mutex_lock(&state->mutex);
+        state->available--;
+        pthread_mutex_unlock(&state->mutex);
+    }
+    return dir;
+}
+
+// Running out of descriptors is waited out, the other workers close theirs as they finish directories
+int openScanDir(ScanDir *dir)
+{
+    int fd = -1;
+
+    for (int attempt = 0; attempt <= OPEN_RETRIES; attempt++)
+    {
+        if (dir->parent != NULL && dir->parent->fd >= 0)
+            fd = openat(dir->parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        else
+            fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd >= 0 || (errno != EMFILE && errno != ENFILE))
+            break;
+        usleep(1000);
+    }
+
+    dir->error = (fd < 0) ? errno : 0;
+    return fd;
+}
+
+int growVisitedDirs(ScanState *state)
+{
+    int size = state->visitedSize > 0 ? state->visitedSize * 2 : 1024;
+    VisitedDir *visited = calloc(size, sizeof(VisitedDir));
+    if (visited == NULL)
+        return -1;
+
+    for (int i = 0; i < state->visitedSize; i++)
+    {
+        if (!state->visited[i].used)
+            continue;
+        unsigned int slot = (unsigned int)state->visited[i].ino & (size - 1);
+        while (visited[slot].used)
+            slot = (slot + 1) & (size - 1);
+        visited[slot] = state->visited[i];
+    }
+
+    free(state->visited);
+    state->visited = visited;
+    state->visitedSize = size;
+    return 0;
+}
+
+// Returns false if the directory was visited before
+bool markVisitedDir(ScanState *state, int fd)
+{
+    struct stat dirStats;
+    bool added = true;
+
+    if (fstat(fd, &dirStats) != 0)
+        return true;
+
+    pthread_mutex_lock(&state->visitedMutex);
+
+    if ((state->numVisited + 1) * 2 > state->visitedSize && growVisitedDirs(state) < 0)
+    {
+        pthread_mutex_unlock(&state->visitedMutex);
+        return true;
+    }
+
+    unsigned int slot = (unsigned int)dirStats.st_ino & (state->visitedSize - 1);
+    while (state->visited[slot].used)
+    {
+        if (state->visited[slot].ino == dirStats.st_ino && state->visited[slot].dev == dirStats.st_dev)
+        {
+            added = false;
+            break;
+        }
+        slot = (slot + 1) & (state->visitedSize - 1);
+    }
+
+    if (added)
+    {
+        state->visited[slot].dev = dirStats.st_dev;
+        state->visited[slot].ino = dirStats.st_ino;
+        state->visited[slot].used = true;
+        state->numVisited++;
+    }
+
+    pthread_mutex_unlock(&state->visitedMutex);
+    return added;
+}
+
+void runScanDir(ScanState *state, int id, ScanDir *dir);
+
+void scanDirectory(ScanState *state, int id, ScanDir *dir)
+{
+    char buffer[GETDENTS_BUFFER_SIZE];
+    char ext[EXTENSION_LENGTH + 1];
+
+    if (dir->fd < 0)
+    {
+        dir->fd = openScanDir(dir);
+        releaseScanDir(dir->parent);
+    }
+
+    // Once cancelled, directories still queued are dropped without being read
+    if (dir->fd < 0 || __atomic_load_n(&state->cancelled, __ATOMIC_RELAXED))
+        return;
+
+    if (!markVisitedDir(state, dir->fd))
+        return;
+
+    int numDirs = 0;
+    long numRead;
+    while ((numRead = syscall(SYS_getdents64, dir->fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (long pos = 0; pos < numRead;)
+        {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + pos);
+            const char *name = entry->d_name;
+            pos += entry->d_reclen;
+
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            bool isDir = (entry->d_type == DT_DIR);
+
+            if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+            {
+                struct stat fileStats;
+                if (fstatat(dir->fd, name, &fileStats, 0) != 0)
+                    continue;
+                isDir = S_ISDIR(fileStats.st_mode);
+            }
+
+            if (isDir)
+            {
+                ScanDir *subDir = newScanDir(dir, name);
+                if (subDir != NULL && addScanEntry(dir, name, subDir) == 0)
+                    numDirs++;
+                else
+                    freeScanTree(subDir);
+                continue;
+            }
+
+            extractExtension(name, EXTENSION_LENGTH, ext);
+            if (match_regex(&state->regex, ext) == 0)
+                addScanEntry(dir, name, NULL);
+        }
+    }
+
+    // What was read before the error is kept, the directory is still reported as unreadable
+    if (numRead < 0)
+        dir->error = errno;
+
+    if (dir->numEntries > 1)
+        qsort(dir->entries, dir->numEntries, sizeof(ScanEntry), compareScanEntries);
+
+    if (state->callback != NULL && !state->callback(dir, state->callbackData))
+        __atomic_store_n(&state->cancelled, true, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&state->cancelled, __ATOMIC_RELAXED))
+        return;
+
+    if (numDirs > 0)
+    {
+        __atomic_add_fetch(&dir->refs, numDirs, __ATOMIC_ACQ_REL);
+
+        pthread_mutex_lock(&state->mutex);
+        state->pending += numDirs;
+        pthread_mutex_unlock(&state->mutex);
+
+        // Pushed in reverse so that this worker continues with the first subdirectory
+        for (int i = dir->numEntries - 1; i >= 0; i--)
+        {
+            if (dir->entries[i].dir != NULL && pushScanDir(state, id, dir->entries[i].dir) != 0)
+                runScanDir(state, id, dir->entries[i].dir);
+        }
+    }
+}
+
+void runScanDir(ScanState *state, int id, ScanDir *dir)
+{
+    scanDirectory(state, id, dir);
+    releaseScanDir(dir);
+
+    pthread_mutex_lock(&state->mutex);
+    if (--state->pending == 0)
+        pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->mutex);
+}
+
+void *scanWorker(void *arg)
+{
+    ScanWorker *worker = (ScanWorker *)arg;
+    ScanState *state = worker->state;
+
+    while (true)
+    {
+        ScanDir *dir = takeScanDir(state, worker->id);
+
+        if (dir == NULL)
+        {
+            pthread_mutex_lock(&state->mutex);
+            while (state->available <= 0 && state->pending > 0)
+                pthread_cond_wait(&state->cond, &state->mutex);
+            bool done = (state->pending == 0);
+            pthread_mutex_unlock(&state->mutex);
+
+            if (done)
+                break;
+            continue;
+        }
+
+        runScanDir(state, worker->id, dir);
+    }
+    return NULL;
+}
+
+int countUnreadableDirs(const ScanDir *dir)
+{
+    int count = (dir->error != 0) ? 1 : 0;
+
+    for (int i = 0; i < dir->numEntries; i++)
+    {
+        if (dir->entries[i].dir != NULL)
+            count += countUnreadableDirs(dir->entries[i].dir);
+    }
+    return count;
+}
+
+ScanDir *scanDirectoryTree(const char *path, const char *allowedExtensions)
+{
+    return scanDirectoryTreeWithCallback(path, allowedExtensions, NULL, NULL);
+}
+
+ScanDir *scanDirectoryTreeWithCallback(const char *path, const char *allowedExtensions, ScanCallback callback, void *data)
+{
+    ScanState state;
+    ScanWorker workers[MAX_SCAN_THREADS];
+    pthread_t threads[MAX_SCAN_THREADS];
+
+    ScanDir *root = newScanDir(NULL, path);
+    if (root == NULL)
+        return NULL;
+
+    root->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root->fd < 0)
+    {
+        freeScanTree(root);
+        return NULL;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.callback = callback;
+    state.callbackData = data;
+    if (regcomp(&state.regex, allowedExtensions, REG_EXTENDED | REG_NOSUB) != 0)
+    {
+        close(root->fd);
+        freeScanTree(root);
+        return NULL;
+    }
+
+    // Scanning is mostly waiting for the file system, so use more threads than cores
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    state.numWorkers = (numCpus > 0) ? (int)numCpus * 2 : 2;
+    if (state.numWorkers > MAX_SCAN_THREADS)
+        state.numWorkers = MAX_SCAN_THREADS;
+
+    pthread_mutex_init(&state.mutex, NULL);
+    pthread_mutex_init(&state.visitedMutex, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    for (int i = 0; i < state.numWorkers; i++)
+        pthread_mutex_init(&state.deques[i].mutex, NULL);
+
+    state.pending = 1;
+    if (pushScanDir(&state, 0, root) != 0)
+        runScanDir(&state, 0, root);
+
+    int numThreads = 0;
+    for (int i = 1; i < state.numWorkers; i++)
+    {
+        workers[i].state = &state;
+        workers[i].id = i;
+        if (pthread_create(&threads[numThreads], NULL, scanWorker, &workers[i]) == 0)
+            numThreads++;
+    }
+
+    workers[0].state = &state;
+    workers[0].id = 0;
+    scanWorker(&workers[0]);
+
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < state.numWorkers; i++)
+    {
+        free(state.deques[i].tasks);
+        pthread_mutex_destroy(&state.deques[i].mutex);
+    }
+    free(state.visited);
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.visitedMutex);
+    pthread_mutex_destroy(&state.mutex);
+    regfree(&state.regex);
+
+    return root;
+}
@@ -0,0 +1,42 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+#include <stdbool.h>
+#include <pthread.h>
+
+#define MAX_SCAN_THREADS 16
+
+struct ScanDir;
+
+typedef struct
+{
+    char *name;
+    struct ScanDir *dir; // NULL for files
+} ScanEntry;
+
+// A scanned directory with its music files and subdirectories, sorted like scandir with compare()
+typedef struct ScanDir
+{
+    char *path;
+    char *name;
+    struct ScanDir *parent;
+    int fd;
+    int error; // errno when the directory couldn't be opened, it has no entries then
+    int refs;
+    ScanEntry *entries;
+    int numEntries;
+    int capacity;
+} ScanDir;
+
+// Called from the scanning threads as soon as a directory has been read, return false to stop the scan
+typedef bool (*ScanCallback)(const ScanDir *dir, void *data);
+
+ScanDir *scanDirectoryTree(const char *path, const char *allowedExtensions);
+
+ScanDir *scanDirectoryTreeWithCallback(const char *path, const char *allowedExtensions, ScanCallback callback, void *data);
+
+// The directories in the tree that couldn't be read
+int countUnreadableDirs(const ScanDir *dir);
+
+void freeScanTree(ScanDir *dir);
+
+#endif
@@ -26,7 +26,8 @@ enum SearchType
     DirOnly = 1,
     FileOnly = 2,
     SearchPlayList = 3,
-    ReturnAllSongs = 4
+    ReturnAllSongs = 4,
+    SearchTags = 5
 };
 
 int existsFile(const char *fname);
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "folderart.h"
+#include "library.h"
+#include "stringpool.h"
+
+/*
+Finds the cover image of a directory without walking the whole tree below it. Images with a name like
+cover.jpg or folder.png win over other images, images closer to the directory win over ones in
+subdirectories, and the largest file breaks ties. Only FOLDER_ART_MAX_DEPTH levels of subdirectories
+and FOLDER_ART_MAX_ENTRIES entries are looked at. The result, also when nothing was found, is remembered
+per directory together with the directory's mtime and stored with the library index.
+*/
+
+typedef struct
+{
+    const char *directory; // Pooled, NULL for an empty slot
+    const char *image;
+    time_t mtime;
+    bool checked; // The directory's mtime was compared during this run
+} FolderCover;
+
+typedef struct
+{
+    char path[MAXPATHLEN];
+    int depth;
+    int rank;
+    off_t size;
+    int entriesLeft;
+} FolderArtSearch;
+
+static const char *preferredNames[] = {"cover", "folder", "front", "album", "albumart"};
+static const int numPreferredNames = sizeof(preferredNames) / sizeof(preferredNames[0]);
+
+static FolderCover *folderCovers = NULL;
+static int folderCoversSize = 0;
+static int numFolderCovers = 0;
+static bool folderCoversChanged = false;
+static pthread_mutex_t folderCoverMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t folderCoversRead = PTHREAD_ONCE_INIT;
+
+unsigned int hashFolder(const char *directory)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    while (*directory != '\0')
+    {
+        hash ^= (unsigned char)*directory++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// The caller holds folderCoverMutex
+FolderCover *lookupFolderCover(const char *directory)
+{
+    if (folderCoversSize == 0)
+        return NULL;
+
+    unsigned int slot = hashFolder(directory) & (folderCoversSize - 1);
+    while (folderCovers[slot].directory != NULL)
+    {
+        if (strcmp(folderCovers[slot].directory, directory) == 0)
+            return &folderCovers[slot];
+        slot = (slot + 1) & (folderCoversSize - 1);
+    }
+    return NULL;
+}
+
+// The caller holds folderCoverMutex
+FolderCover *insertFolderCover(const char *directory)
+{
+    if ((numFolderCovers + 1) * 2 > folderCoversSize)
+    {
+        int size = folderCoversSize > 0 ? folderCoversSize * 2 : 256;
+        FolderCover *table = calloc(size, sizeof(FolderCover));
+        if (table == NULL)
+            return NULL;
+
+        for (int i = 0; i < folderCoversSize; i++)
+        {
+            if (folderCovers[i].directory == NULL)
+                continue;
+            unsigned int slot = hashFolder(folderCovers[i].directory) & (size - 1);
+            while (table[slot].directory != NULL)
+                slot = (slot + 1) & (size - 1);
+            table[slot] = folderCovers[i];
+        }
+        free(folderCovers);
+        folderCovers = table;
+        folderCoversSize = size;
+    }
+
+    unsigned int slot = hashFolder(directory) & (folderCoversSize - 1);
+    while (folderCovers[slot].directory != NULL)
+        slot = (slot + 1) & (folderCoversSize - 1);
+
+    folderCovers[slot].directory = poolStrdup(directory);
+    if (folderCovers[slot].directory == NULL)
+        return NULL;
+    numFolderCovers++;
+    return &folderCovers[slot];
+}
+
+void rememberFolderCover(const char *directory, const char *image, time_t mtime)
+{
+    pthread_mutex_lock(&folderCoverMutex);
+
+    // What was found during this run is newer than what is stored
+    if (lookupFolderCover(directory) == NULL)
+    {
+        FolderCover *entry = insertFolderCover(directory);
+        if (entry != NULL)
+        {
+            entry->image = (image != NULL && image[0] != '\0') ? poolStrdup(image) : NULL;
+            entry->mtime = mtime;
+            entry->checked = false;
+        }
+    }
+
+    pthread_mutex_unlock(&folderCoverMutex);
+}
+
+int getImageRank(const char *name)
+{
+    const char *extension = strrchr(name, '.');
+
+    if (extension == NULL || (strcasecmp(extension, ".jpg") != 0 && strcasecmp(extension, ".jpeg") != 0 &&
+                              strcasecmp(extension, ".png") != 0 && strcasecmp(extension, ".gif") != 0))
+        return -1;
+
+    size_t length = extension - name;
+    for (int i = 0; i < numPreferredNames; i++)
+    {
+        if (strlen(preferredNames[i]) == length && strncasecmp(name, preferredNames[i], length) == 0)
+            return i;
+    }
+    return numPreferredNames;
+}
+
+void searchFolderArt(const char *directory, int depth, FolderArtSearch *search)
+{
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+    struct stat fileStats;
+    bool hasSubdirectories = false;
+    size_t length = strlen(directory);
+    const char *separator = (length > 0 && directory[length - 1] == '/') ? "" : "/";
+
+    if (dir == NULL)
+        return;
+
+    while ((entry = readdir(dir)) != NULL && search->entriesLeft > 0)
+    {
+        search->entriesLeft--;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        if (entry->d_type == DT_DIR || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+            hasSubdirectories = true;
+        if (entry->d_type == DT_DIR)
+            continue;
+
+        // Only images are stat'ed, everything else is skipped by name
+        int rank = getImageRank(entry->d_name);
+        if (rank < 0 || fstatat(dirfd(dir), entry->d_name, &fileStats, 0) != 0 || !S_ISREG(fileStats.st_mode))
+            continue;
+
+        bool better = (search->path[0] == '\0' || depth < search->depth ||
+                       (depth == search->depth && (rank < search->rank || (rank == search->rank && fileStats.st_size > search->size))));
+
+        if (better && length + strlen(entry->d_name) + 2 <= MAXPATHLEN)
+        {
+            snprintf(search->path, sizeof(search->path), "%s%s%s", directory, separator, entry->d_name);
+            search->depth = depth;
+            search->rank = rank;
+            search->size = fileStats.st_size;
+        }
+    }
+
+    // Subdirectories can only hold a better image as long as nothing was found at this depth or above
+    if (hasSubdirectories && depth < FOLDER_ART_MAX_DEPTH && (search->path[0] == '\0' || search->depth > depth))
+    {
+        rewinddir(dir);
+        while ((entry = readdir(dir)) != NULL && search->entriesLeft > 0)
+        {
+            char subDirectory[MAXPATHLEN];
+
+            if (entry->d_name[0] == '.' || (entry->d_type != DT_DIR && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN))
+                continue;
+            if (length + strlen(entry->d_name) + 2 > MAXPATHLEN)
+                continue;
+
+            snprintf(subDirectory, sizeof(subDirectory), "%s%s%s", directory, separator, entry->d_name);
+            searchFolderArt(subDirectory, depth + 1, search);
+        }
+    }
+
+    closedir(dir);
+}
+
+void readStoredFolderCovers()
+{
+    readLibraryFolderCovers();
+}
+
+const char *findFolderCover(const char *directory)
+{
+    struct stat dirStats;
+    const char *image = NULL;
+    bool found = false;
+    time_t mtime = 0;
+
+    pthread_once(&folderCoversRead, readStoredFolderCovers);
+
+    pthread_mutex_lock(&folderCoverMutex);
+    FolderCover *entry = lookupFolderCover(directory);
+    if (entry != NULL)
+    {
+        found = true;
+        image = entry->image;
+        mtime = entry->mtime;
+        if (entry->checked)
+        {
+            pthread_mutex_unlock(&folderCoverMutex);
+            return image;
+        }
+    }
+    pthread_mutex_unlock(&folderCoverMutex);
+
+    if (stat(directory, &dirStats) != 0)
+        return image;
+
+    bool changed = (!found || mtime != dirStats.st_mtime);
+    if (changed)
+    {
+        FolderArtSearch search;
+        search.path[0] = '\0';
+        search.entriesLeft = FOLDER_ART_MAX_ENTRIES;
+        searchFolderArt(directory, 0, &search);
+        image = (search.path[0] != '\0') ? poolStrdup(search.path) : NULL;
+    }
+
+    pthread_mutex_lock(&folderCoverMutex);
+    entry = lookupFolderCover(directory);
+    if (entry == NULL)
+        entry = insertFolderCover(directory);
+    if (entry != NULL)
+    {
+        entry->image = image;
+        entry->mtime = dirStats.st_mtime;
+        entry->checked = true;
+        if (changed)
+            folderCoversChanged = true;
+    }
+    pthread_mutex_unlock(&folderCoverMutex);
+
+    return image;
+}
+
+bool haveNewFolderCovers()
+{
+    pthread_mutex_lock(&folderCoverMutex);
+    bool changed = folderCoversChanged;
+    pthread_mutex_unlock(&folderCoverMutex);
+    return changed;
+}
+
+void writeFolderCovers(FILE *file)
+{
+    pthread_mutex_lock(&folderCoverMutex);
+    for (int i = 0; i < folderCoversSize; i++)
+    {
+        FolderCover *entry = &folderCovers[i];
+        if (entry->directory == NULL)
+            continue;
+        fprintf(file, "@\t%lld\t", (long long)entry->mtime);
+        writeLibraryPath(file, entry->directory);
+        fputc('\t', file);
+        writeLibraryPath(file, entry->image != NULL ? entry->image : "");
+        fputc('\n', file);
+    }
+    folderCoversChanged = false;
+    pthread_mutex_unlock(&folderCoverMutex);
+}
+
+// The strings stay in the string pool until freeStringPool()
+void freeFolderCovers()
+{
+    pthread_mutex_lock(&folderCoverMutex);
+    free(folderCovers);
+    folderCovers = NULL;
+    folderCoversSize = 0;
+    numFolderCovers = 0;
+    pthread_mutex_unlock(&folderCoverMutex);
+}
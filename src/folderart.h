@@ -0,0 +1,22 @@
+#ifndef FOLDERART_H
+#define FOLDERART_H
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define FOLDER_ART_MAX_DEPTH 2
+#define FOLDER_ART_MAX_ENTRIES 4096
+
+// The image used as cover for the songs of a directory, NULL if there is none. Results are remembered per directory.
+const char *findFolderCover(const char *directory);
+
+// Adds a result found in an earlier run, it is checked against the directory's mtime before it is used
+void rememberFolderCover(const char *directory, const char *image, time_t mtime);
+
+bool haveNewFolderCovers();
+
+void writeFolderCovers(FILE *file);
+
+void freeFolderCovers();
+
+#endif
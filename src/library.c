@@ -0,0 +1,707 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "library.h"
+#include "metadata.h"
+#include "file.h"
+#include "folderart.h"
+#include "dirscan.h"
+
+#define LIBRARY_FIELD_COUNT 8
+#define MAX_TOKENS_PER_FIELD 32
+
+const char LIBRARY_FILENAME[] = ".cue.library";
+
+void getLibraryFilePath(char *filePath)
+{
+    struct passwd *pw = getpwuid(getuid());
+    snprintf(filePath, MAXPATHLEN, "%s/%s", pw->pw_dir, LIBRARY_FILENAME);
+}
+
+unsigned int hashString(const char *str)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    while (*str != '\0')
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int tokenizeText(const char *text, char tokens[][LIBRARY_TOKEN_LENGTH], int maxTokens)
+{
+    int count = 0;
+    int length = 0;
+
+    if (text == NULL || maxTokens <= 0)
+        return 0;
+
+    for (const char *p = text;; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+
+        // Bytes above 0x7f are kept so that accented names in UTF-8 still form words
+        if (c != '\0' && (isalnum(c) || c >= 0x80))
+        {
+            if (length < LIBRARY_TOKEN_LENGTH - 1)
+                tokens[count][length++] = tolower(c);
+            continue;
+        }
+
+        if (length > 0)
+        {
+            tokens[count][length] = '\0';
+            length = 0;
+            if (++count == maxTokens)
+                break;
+        }
+
+        if (c == '\0')
+            break;
+    }
+    return count;
+}
+
+void sanitizeField(char *str)
+{
+    for (; *str != '\0'; str++)
+    {
+        if (*str == '\t' || *str == '\n' || *str == '\r')
+            *str = ' ';
+    }
+}
+
+// Paths are written with tabs, newlines and backslashes escaped, so that they can't break the line format
+void writeLibraryPath(FILE *file, const char *path)
+{
+    for (; *path != '\0'; path++)
+    {
+        switch (*path)
+        {
+        case '\\':
+            fputs("\\\\", file);
+            break;
+        case '\t':
+            fputs("\\t", file);
+            break;
+        case '\n':
+            fputs("\\n", file);
+            break;
+        case '\r':
+            fputs("\\r", file);
+            break;
+        default:
+            fputc(*path, file);
+        }
+    }
+}
+
+char *unescapeLibraryPath(char *path)
+{
+    char *out = path;
+    for (const char *in = path; *in != '\0'; in++)
+    {
+        if (*in == '\\' && in[1] != '\0' && strchr("\\tnr", in[1]) != NULL)
+        {
+            in++;
+            *out++ = (*in == 't') ? '\t' : (*in == 'n') ? '\n' : (*in == 'r') ? '\r' : '\\';
+        }
+        else
+        {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return path;
+}
+
+LibraryEntry *appendEntry(LibraryIndex *index)
+{
+    if (index->count == index->capacity)
+    {
+        int capacity = index->capacity > 0 ? index->capacity * 2 : 1024;
+        LibraryEntry *entries = realloc(index->entries, capacity * sizeof(LibraryEntry));
+        if (entries == NULL)
+            return NULL;
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    LibraryEntry *entry = &index->entries[index->count++];
+    memset(entry, 0, sizeof(LibraryEntry));
+    return entry;
+}
+
+void freeEntry(LibraryEntry *entry)
+{
+    free(entry->filePath);
+    free(entry->title);
+    free(entry->artist);
+    free(entry->albumArtist);
+    free(entry->album);
+}
+
+void setEntryFormat(LibraryEntry *entry)
+{
+    const char *extension = getFileExtension(entry->filePath);
+    entry->format[0] = '\0';
+    if (extension == NULL)
+        return;
+    snprintf(entry->format, sizeof(entry->format), "%s", extension);
+    stringToLower(entry->format);
+}
+
+int addDirectory(LibraryIndex *index, const char *path, time_t mtime)
+{
+    if (index->numDirectories == index->directoryCapacity)
+    {
+        int capacity = index->directoryCapacity > 0 ? index->directoryCapacity * 2 : 256;
+        LibraryDirectory *directories = realloc(index->directories, capacity * sizeof(LibraryDirectory));
+        if (directories == NULL)
+            return -1;
+        index->directories = directories;
+        index->directoryCapacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    index->directories[index->numDirectories].path = copy;
+    index->directories[index->numDirectories].mtime = mtime;
+    index->numDirectories++;
+    return 0;
+}
+
+PostingList *appendPostingList(LibraryIndex *index, int *capacity)
+{
+    if (index->numPostings == *capacity)
+    {
+        int newCapacity = *capacity > 0 ? *capacity * 2 : 4096;
+        PostingList *postings = realloc(index->postings, newCapacity * sizeof(PostingList));
+        if (postings == NULL)
+            return NULL;
+        index->postings = postings;
+        *capacity = newCapacity;
+    }
+    PostingList *list = &index->postings[index->numPostings++];
+    memset(list, 0, sizeof(PostingList));
+    return list;
+}
+
+// Posting lines: "=", the key, the number of entries and the entries separated by spaces
+bool readPostingLine(LibraryIndex *index, int *capacity, char *line)
+{
+    char *rest = line;
+    strsep(&rest, "\t");
+    char *key = strsep(&rest, "\t");
+    char *count = strsep(&rest, "\t");
+    if (key == NULL || count == NULL || rest == NULL)
+        return false;
+
+    int numDocs = atoi(count);
+    if (numDocs <= 0)
+        return false;
+
+    PostingList *list = appendPostingList(index, capacity);
+    if (list == NULL)
+        return false;
+    list->key = strdup(key);
+    list->docs = malloc(numDocs * sizeof(int));
+    if (list->key == NULL || list->docs == NULL)
+        return false;
+    list->capacity = numDocs;
+
+    char *end = rest;
+    for (int i = 0; i < numDocs; i++)
+    {
+        char *start = end;
+        long doc = strtol(start, &end, 10);
+        if (end == start || doc < 0 || doc >= index->count)
+            return false;
+        list->docs[list->count++] = (int)doc;
+    }
+    return true;
+}
+
+void freePostingLists(LibraryIndex *index)
+{
+    for (int i = 0; i < index->numPostings; i++)
+    {
+        free(index->postings[i].key);
+        free(index->postings[i].docs);
+    }
+    free(index->postings);
+    index->postings = NULL;
+    index->numPostings = 0;
+}
+
+void readLibraryFile(LibraryIndex *index)
+{
+    char filePath[MAXPATHLEN];
+    getLibraryFilePath(filePath);
+
+    FILE *file = fopen(filePath, "r");
+    if (file == NULL)
+        return;
+
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    int postingCapacity = 0;
+    bool postingsValid = true;
+    while (getline(&line, &lineCapacity, file) != -1)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        // Folder art lines: "@", the directory's mtime, the directory and the image, empty if it has none
+        if (line[0] == '@')
+        {
+            char *rest = line;
+            strsep(&rest, "\t");
+            char *mtime = strsep(&rest, "\t");
+            char *directory = strsep(&rest, "\t");
+            if (mtime != NULL && directory != NULL && rest != NULL)
+                rememberFolderCover(unescapeLibraryPath(directory), unescapeLibraryPath(rest), (time_t)atoll(mtime));
+            continue;
+        }
+
+        if (index == NULL)
+            continue;
+
+        // Directory lines: "%", the directory's mtime and the directory, the first one is the library's root
+        if (line[0] == '%')
+        {
+            char *rest = line;
+            strsep(&rest, "\t");
+            char *mtime = strsep(&rest, "\t");
+            if (mtime != NULL && rest != NULL)
+                addDirectory(index, unescapeLibraryPath(rest), (time_t)atoll(mtime));
+            continue;
+        }
+
+        // Written after the entries they refer to
+        if (line[0] == '=')
+        {
+            if (postingsValid)
+                postingsValid = readPostingLine(index, &postingCapacity, line);
+            continue;
+        }
+
+        char *fields[LIBRARY_FIELD_COUNT];
+        char *rest = line;
+        int numFields = 0;
+        while (numFields < LIBRARY_FIELD_COUNT && rest != NULL)
+            fields[numFields++] = strsep(&rest, "\t");
+
+        if (numFields != LIBRARY_FIELD_COUNT || fields[3][0] == '\0')
+            continue;
+
+        LibraryEntry *entry = appendEntry(index);
+        if (entry == NULL)
+            break;
+        entry->mtime = (time_t)atoll(fields[0]);
+        entry->duration = atof(fields[1]);
+        entry->year = atoi(fields[2]);
+        entry->filePath = strdup(unescapeLibraryPath(fields[3]));
+        entry->title = strdup(fields[4]);
+        entry->artist = strdup(fields[5]);
+        entry->albumArtist = strdup(fields[6]);
+        entry->album = strdup(fields[7]);
+        setEntryFormat(entry);
+    }
+    free(line);
+    fclose(file);
+
+    // A truncated or damaged file makes the posting lists be built again
+    if (index != NULL && !postingsValid)
+        freePostingLists(index);
+}
+
+// Written to a temporary file that replaces the index once complete, so a crash never leaves it truncated
+void saveLibraryIndex(LibraryIndex *index)
+{
+    char filePath[MAXPATHLEN];
+    char tempPath[MAXPATHLEN];
+    char buffer[65536];
+
+    getLibraryFilePath(filePath);
+    if (snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", filePath) >= (int)sizeof(tempPath))
+        return;
+
+    int fd = mkstemp(tempPath);
+    if (fd < 0)
+        return;
+    fchmod(fd, 0644);
+
+    FILE *file = fdopen(fd, "w");
+    if (file == NULL)
+    {
+        close(fd);
+        unlink(tempPath);
+        return;
+    }
+    setvbuf(file, buffer, _IOFBF, sizeof(buffer));
+
+    for (int i = 0; i < index->count; i++)
+    {
+        LibraryEntry *entry = &index->entries[i];
+        fprintf(file, "%lld\t%.3f\t%d\t", (long long)entry->mtime, entry->duration, entry->year);
+        writeLibraryPath(file, entry->filePath);
+        fprintf(file, "\t%s\t%s\t%s\t%s\n", entry->title, entry->artist, entry->albumArtist, entry->album);
+    }
+    for (int i = 0; i < index->numDirectories; i++)
+    {
+        fprintf(file, "%%\t%lld\t", (long long)index->directories[i].mtime);
+        writeLibraryPath(file, index->directories[i].path);
+        fputc('\n', file);
+    }
+    for (int i = 0; i < index->numPostings; i++)
+    {
+        PostingList *list = &index->postings[i];
+        fprintf(file, "=\t%s\t%d\t", list->key, list->count);
+        for (int j = 0; j < list->count; j++)
+            fprintf(file, (j > 0) ? " %d" : "%d", list->docs[j]);
+        fputc('\n', file);
+    }
+    writeFolderCovers(file);
+
+    bool failed = (fflush(file) != 0 || ferror(file) || fsync(fd) != 0);
+    if (fclose(file) != 0 || failed || rename(tempPath, filePath) != 0)
+        unlink(tempPath);
+}
+
+void readLibraryFolderCovers()
+{
+    readLibraryFile(NULL);
+}
+
+void indexFile(LibraryEntry *entry, const char *filePath, time_t mtime)
+{
+    TagSettings tags;
+    double duration = 0.0;
+
+    extractTagsAndDuration(filePath, &tags, &duration);
+    sanitizeField(tags.title);
+    sanitizeField(tags.artist);
+    sanitizeField(tags.album_artist);
+    sanitizeField(tags.album);
+
+    entry->filePath = strdup(filePath);
+    entry->title = strdup(tags.title);
+    entry->artist = strdup(tags.artist);
+    entry->albumArtist = strdup(tags.album_artist);
+    entry->album = strdup(tags.album);
+    entry->duration = duration;
+    entry->mtime = mtime;
+    if (sscanf(tags.date, "%d", &entry->year) != 1)
+        entry->year = 0;
+    setEntryFormat(entry);
+}
+
+int *buildPathTable(LibraryIndex *index, int *tableSize)
+{
+    int size = 16;
+    while (size < index->count * 2)
+        size *= 2;
+
+    int *table = malloc(size * sizeof(int));
+    if (table == NULL)
+        return NULL;
+    for (int i = 0; i < size; i++)
+        table[i] = -1;
+
+    for (int i = 0; i < index->count; i++)
+    {
+        unsigned int slot = hashString(index->entries[i].filePath) & (size - 1);
+        while (table[slot] != -1)
+            slot = (slot + 1) & (size - 1);
+        table[slot] = i;
+    }
+    *tableSize = size;
+    return table;
+}
+
+int lookupPath(LibraryIndex *index, int *table, int tableSize, const char *filePath)
+{
+    unsigned int slot = hashString(filePath) & (tableSize - 1);
+    while (table[slot] != -1)
+    {
+        const char *candidate = index->entries[table[slot]].filePath;
+        if (candidate != NULL && strcmp(candidate, filePath) == 0)
+            return table[slot];
+        slot = (slot + 1) & (tableSize - 1);
+    }
+    return -1;
+}
+
+// The stored index is still valid when no directory or file of the library has changed since it was scanned.
+// Only the files are stat'ed here, their tags are read again only when they changed.
+bool isLibraryCurrent(LibraryIndex *index, const char *musicPath)
+{
+    struct stat dirStats;
+    struct stat fileStats;
+
+    if (index->numDirectories == 0 || strcmp(index->directories[0].path, musicPath) != 0)
+        return false;
+    if (index->count > 0 && index->numPostings == 0)
+        return false;
+
+    for (int i = 0; i < index->numDirectories; i++)
+    {
+        if (stat(index->directories[i].path, &dirStats) != 0 || dirStats.st_mtime != index->directories[i].mtime)
+            return false;
+    }
+
+    // Retagging a file in place changes its mtime, but not the directory's
+    for (int i = 0; i < index->count; i++)
+    {
+        if (stat(index->entries[i].filePath, &fileStats) != 0 || fileStats.st_mtime != index->entries[i].mtime)
+            return false;
+    }
+    return true;
+}
+
+void indexScannedDir(const ScanDir *dir, LibraryIndex *index, LibraryIndex *cached, int *table, int tableSize, time_t scanStart)
+{
+    struct stat fileStats;
+
+    // A directory or file changed during the scan, or within the same second before it, is stored as unknown and read again
+    if (stat(dir->path, &fileStats) == 0)
+        addDirectory(index, dir->path, (fileStats.st_mtime < scanStart) ? fileStats.st_mtime : 0);
+
+    for (int i = 0; i < dir->numEntries; i++)
+    {
+        ScanEntry *scanEntry = &dir->entries[i];
+        char filePath[MAXPATHLEN];
+
+        if (scanEntry->dir != NULL)
+        {
+            indexScannedDir(scanEntry->dir, index, cached, table, tableSize, scanStart);
+            continue;
+        }
+
+        snprintf(filePath, sizeof(filePath), "%s/%s", dir->path, scanEntry->name);
+        if (stat(filePath, &fileStats) != 0)
+            continue;
+
+        LibraryEntry *entry = appendEntry(index);
+        if (entry == NULL)
+            return;
+
+        // Reuse the cached tags as long as the file hasn't been modified since it was indexed
+        int found = lookupPath(cached, table, tableSize, filePath);
+        if (found >= 0 && cached->entries[found].mtime == fileStats.st_mtime)
+        {
+            *entry = cached->entries[found];
+            memset(&cached->entries[found], 0, sizeof(LibraryEntry));
+            continue;
+        }
+
+        indexFile(entry, filePath, (fileStats.st_mtime < scanStart) ? fileStats.st_mtime : 0);
+    }
+}
+
+int loadLibraryIndex(LibraryIndex *index, const char *musicPath)
+{
+    int tableSize = 0;
+
+    memset(index, 0, sizeof(LibraryIndex));
+
+    readLibraryFile(index);
+    if (isLibraryCurrent(index, musicPath))
+        return index->count;
+
+    // Something changed, scan the library again and only read the tags of new or modified files
+    LibraryIndex cached = *index;
+    memset(index, 0, sizeof(LibraryIndex));
+
+    time_t scanStart = time(NULL);
+    int *table = buildPathTable(&cached, &tableSize);
+    ScanDir *root = scanDirectoryTree(musicPath, ALLOWED_EXTENSIONS);
+    if (table == NULL || root == NULL)
+    {
+        free(table);
+        freeLibraryIndex(&cached);
+        return -1;
+    }
+
+    indexScannedDir(root, index, &cached, table, tableSize, scanStart);
+
+    free(table);
+    freeScanTree(root);
+    freeLibraryIndex(&cached);
+
+    // Looked up once per directory, so playing a song without embedded art doesn't search its folder
+    for (int i = 0; i < index->numDirectories; i++)
+        findFolderCover(index->directories[i].path);
+
+    buildPostingLists(index);
+    saveLibraryIndex(index);
+
+    return index->count;
+}
+
+typedef struct
+{
+    int *slots;
+    int size;
+} PostingTable;
+
+int addPosting(LibraryIndex *index, PostingTable *table, int *capacity, const char *key, int doc)
+{
+    // Keep the open addressing table at most half full
+    if ((index->numPostings + 1) * 2 > table->size)
+    {
+        int size = table->size > 0 ? table->size * 2 : 4096;
+        int *slots = malloc(size * sizeof(int));
+        if (slots == NULL)
+            return -1;
+        for (int i = 0; i < size; i++)
+            slots[i] = -1;
+        for (int i = 0; i < index->numPostings; i++)
+        {
+            unsigned int slot = hashString(index->postings[i].key) & (size - 1);
+            while (slots[slot] != -1)
+                slot = (slot + 1) & (size - 1);
+            slots[slot] = i;
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->size = size;
+    }
+
+    unsigned int slot = hashString(key) & (table->size - 1);
+    while (table->slots[slot] != -1 && strcmp(index->postings[table->slots[slot]].key, key) != 0)
+        slot = (slot + 1) & (table->size - 1);
+
+    if (table->slots[slot] == -1)
+    {
+        PostingList *list = appendPostingList(index, capacity);
+        if (list == NULL)
+            return -1;
+        list->key = strdup(key);
+        table->slots[slot] = index->numPostings - 1;
+    }
+
+    PostingList *list = &index->postings[table->slots[slot]];
+
+    // Documents are added in order, so the lists stay sorted and duplicates are adjacent
+    if (list->count > 0 && list->docs[list->count - 1] == doc)
+        return 0;
+
+    if (list->count == list->capacity)
+    {
+        int newCapacity = list->capacity > 0 ? list->capacity * 2 : 4;
+        int *docs = realloc(list->docs, newCapacity * sizeof(int));
+        if (docs == NULL)
+            return -1;
+        list->docs = docs;
+        list->capacity = newCapacity;
+    }
+    list->docs[list->count++] = doc;
+    return 0;
+}
+
+void addFieldPostings(LibraryIndex *index, PostingTable *table, int *capacity, char field, const char *text, int doc)
+{
+    char tokens[MAX_TOKENS_PER_FIELD][LIBRARY_TOKEN_LENGTH];
+    char key[LIBRARY_TOKEN_LENGTH + 2];
+
+    int numTokens = tokenizeText(text, tokens, MAX_TOKENS_PER_FIELD);
+    for (int i = 0; i < numTokens; i++)
+    {
+        snprintf(key, sizeof(key), "%c:%s", field, tokens[i]);
+        addPosting(index, table, capacity, key, doc);
+    }
+}
+
+int comparePostings(const void *a, const void *b)
+{
+    return strcmp(((const PostingList *)a)->key, ((const PostingList *)b)->key);
+}
+
+void buildPostingLists(LibraryIndex *index)
+{
+    PostingTable table = {NULL, 0};
+    int capacity = 0;
+    char key[LIBRARY_TOKEN_LENGTH + 2];
+
+    for (int doc = 0; doc < index->count; doc++)
+    {
+        LibraryEntry *entry = &index->entries[doc];
+        addFieldPostings(index, &table, &capacity, 't', entry->title, doc);
+        addFieldPostings(index, &table, &capacity, 'a', entry->artist, doc);
+        addFieldPostings(index, &table, &capacity, 'b', entry->albumArtist, doc);
+        addFieldPostings(index, &table, &capacity, 'l', entry->album, doc);
+        addFieldPostings(index, &table, &capacity, 'f', entry->format, doc);
+
+        // The file name stands in for the title when a file has no tags
+        const char *fileName = strrchr(entry->filePath, '/');
+        addFieldPostings(index, &table, &capacity, 'n', (fileName != NULL) ? fileName + 1 : entry->filePath, doc);
+
+        // Zero padded so that a year range is a contiguous range of sorted keys
+        if (entry->year > 0 && entry->year < 10000)
+        {
+            snprintf(key, sizeof(key), "y:%04d", entry->year);
+            addPosting(index, &table, &capacity, key, doc);
+        }
+    }
+    free(table.slots);
+
+    qsort(index->postings, index->numPostings, sizeof(PostingList), comparePostings);
+}
+
+int lowerBound(LibraryIndex *index, const char *key, bool inclusive)
+{
+    int low = 0;
+    int high = index->numPostings;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        int cmp = strcmp(index->postings[mid].key, key);
+        if (cmp < 0 || (!inclusive && cmp == 0))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+PostingList *findPostingList(LibraryIndex *index, const char *key)
+{
+    int i = lowerBound(index, key, true);
+    if (i < index->numPostings && strcmp(index->postings[i].key, key) == 0)
+        return &index->postings[i];
+    return NULL;
+}
+
+// Finds the posting lists whose keys are within [low, high], returns how many there are
+int findPostingRange(LibraryIndex *index, const char *low, const char *high, int *first, int *last)
+{
+    *first = lowerBound(index, low, true);
+    *last = lowerBound(index, high, false);
+    return (*last > *first) ? *last - *first : 0;
+}
+
+void freeLibraryIndex(LibraryIndex *index)
+{
+    if (index == NULL)
+        return;
+
+    for (int i = 0; i < index->count; i++)
+        freeEntry(&index->entries[i]);
+    free(index->entries);
+
+    freePostingLists(index);
+
+    for (int i = 0; i < index->numDirectories; i++)
+        free(index->directories[i].path);
+    free(index->directories);
+
+    memset(index, 0, sizeof(LibraryIndex));
+}
@@ -0,0 +1,73 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include "playlist.h"
+
+#define LIBRARY_FORMAT_LENGTH 8
+#define LIBRARY_TOKEN_LENGTH 64
+
+typedef struct
+{
+    char *filePath;
+    char *title;
+    char *artist;
+    char *albumArtist;
+    char *album;
+    int year;
+    double duration;
+    char format[LIBRARY_FORMAT_LENGTH];
+    time_t mtime;
+} LibraryEntry;
+
+// Sorted list of the entries that contain a token, keyed by field prefix and token ("a:radiohead")
+typedef struct
+{
+    char *key;
+    int *docs;
+    int count;
+    int capacity;
+} PostingList;
+
+// A directory of the library and its mtime when it was scanned, adding, removing or renaming a file in it changes the mtime
+typedef struct
+{
+    char *path;
+    time_t mtime;
+} LibraryDirectory;
+
+typedef struct
+{
+    LibraryEntry *entries;
+    int count;
+    int capacity;
+    PostingList *postings;
+    int numPostings;
+    LibraryDirectory *directories;
+    int numDirectories;
+    int directoryCapacity;
+} LibraryIndex;
+
+extern const char LIBRARY_FILENAME[];
+
+int tokenizeText(const char *text, char tokens[][LIBRARY_TOKEN_LENGTH], int maxTokens);
+
+int loadLibraryIndex(LibraryIndex *index, const char *musicPath);
+
+void saveLibraryIndex(LibraryIndex *index);
+
+void writeLibraryPath(FILE *file, const char *path);
+
+void readLibraryFolderCovers();
+
+void buildPostingLists(LibraryIndex *index);
+
+PostingList *findPostingList(LibraryIndex *index, const char *key);
+
+int findPostingRange(LibraryIndex *index, const char *low, const char *high, int *first, int *last);
+
+void freeLibraryIndex(LibraryIndex *index);
+
+#endif
@@ -67,5 +67,57 @@ int extractTags(const char *input_file, TagSettings *tag_settings)
     // Close the pipe
     pclose(pipe);
 
+    return 0;
+}
+
+void copyTag(AVDictionary *dict, const char *key, char *dest, size_t size)
+{
+    AVDictionaryEntry *entry = av_dict_get(dict, key, NULL, 0);
+    if (entry != NULL && dest[0] == '\0')
+        snprintf(dest, size, "%s", entry->value);
+}
+
+// Reads tags and duration in-process with libavformat, used when indexing the whole library
+int extractTagsAndDuration(const char *input_file, TagSettings *tag_settings, double *duration)
+{
+    AVFormatContext *fmt_ctx = NULL;
+
+    memset(tag_settings, 0, sizeof(TagSettings));
+    *duration = 0.0;
+
+    if (avformat_open_input(&fmt_ctx, input_file, NULL, NULL) < 0)
+        return 1;
+
+    // Only probe the streams when the container header doesn't carry the duration
+    if (fmt_ctx->duration == AV_NOPTS_VALUE || fmt_ctx->duration <= 0)
+        avformat_find_stream_info(fmt_ctx, NULL);
+
+    if (fmt_ctx->duration != AV_NOPTS_VALUE && fmt_ctx->duration > 0)
+        *duration = (double)fmt_ctx->duration / AV_TIME_BASE;
+
+    // Ogg and Opus files keep their tags on the audio stream instead of the container
+    AVDictionary *dicts[2] = {fmt_ctx->metadata, NULL};
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+        {
+            dicts[1] = fmt_ctx->streams[i]->metadata;
+            break;
+        }
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (dicts[i] == NULL)
+            continue;
+        copyTag(dicts[i], "title", tag_settings->title, sizeof(tag_settings->title));
+        copyTag(dicts[i], "artist", tag_settings->artist, sizeof(tag_settings->artist));
+        copyTag(dicts[i], "album_artist", tag_settings->album_artist, sizeof(tag_settings->album_artist));
+        copyTag(dicts[i], "album", tag_settings->album, sizeof(tag_settings->album));
+        copyTag(dicts[i], "date", tag_settings->date, sizeof(tag_settings->date));
+    }
+
+    avformat_close_input(&fmt_ctx);
+
     return 0;
 }
\ No newline at end of file
@@ -35,4 +35,6 @@ typedef struct
 
 int extractTags(const char *input_file, TagSettings *tag_settings);
 
+int extractTagsAndDuration(const char *input_file, TagSettings *tag_settings, double *duration);
+
 #endif
\ No newline at end of file
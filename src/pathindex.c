@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pathindex.h"
+
+/*
+Open addressing with linear probing. Removal shifts the following entries back instead of
+leaving tombstones, so lookups stay short however many songs come and go.
+*/
+
+#define PATH_INDEX_MIN_SIZE 64
+
+unsigned int hashSong(const SongInfo *song)
+{
+    unsigned int hash = 2166136261u ^ (unsigned int)song->dirId;
+    hash *= 16777619u;
+    for (const char *p = song->fileName; *p != '\0'; p++)
+    {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool isSameSong(const SongInfo *a, const SongInfo *b)
+{
+    return a->dirId == b->dirId && (a->fileName == b->fileName || strcmp(a->fileName, b->fileName) == 0);
+}
+
+void insertSlot(Node **slots, int size, Node *node)
+{
+    unsigned int slot = hashSong(&node->song) & (size - 1);
+    while (slots[slot] != NULL)
+        slot = (slot + 1) & (size - 1);
+    slots[slot] = node;
+}
+
+int resizePathIndex(PathIndex *index, int size)
+{
+    Node **slots = calloc(size, sizeof(Node *));
+    if (slots == NULL)
+        return -1;
+
+    for (int i = 0; i < index->size; i++)
+    {
+        if (index->slots[i] != NULL)
+            insertSlot(slots, size, index->slots[i]);
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->size = size;
+    return 0;
+}
+
+PathIndex *createPathIndex(PlayList *list)
+{
+    PathIndex *index = calloc(1, sizeof(PathIndex));
+    if (index == NULL)
+        return NULL;
+
+    int size = PATH_INDEX_MIN_SIZE;
+    while (list != NULL && size < list->count * 2)
+        size *= 2;
+
+    if (resizePathIndex(index, size) < 0)
+    {
+        free(index);
+        return NULL;
+    }
+
+    for (Node *node = (list != NULL) ? list->head : NULL; node != NULL; node = node->next)
+        addToPathIndex(index, node);
+
+    return index;
+}
+
+void freePathIndex(PathIndex *index)
+{
+    if (index == NULL)
+        return;
+    free(index->slots);
+    free(index);
+}
+
+Node *findInPathIndex(PathIndex *index, const SongInfo *song)
+{
+    if (index == NULL || song->fileName == NULL)
+        return NULL;
+
+    unsigned int slot = hashSong(song) & (index->size - 1);
+    while (index->slots[slot] != NULL)
+    {
+        if (isSameSong(&index->slots[slot]->song, song))
+            return index->slots[slot];
+        slot = (slot + 1) & (index->size - 1);
+    }
+    return NULL;
+}
+
+// Returns 1 if the song was added, 0 if it was already there
+int addToPathIndex(PathIndex *index, Node *node)
+{
+    if (index == NULL || node->song.fileName == NULL)
+        return -1;
+
+    if (findInPathIndex(index, &node->song) != NULL)
+        return 0;
+
+    if ((index->count + 1) * 2 > index->size && resizePathIndex(index, index->size * 2) < 0)
+        return -1;
+
+    insertSlot(index->slots, index->size, node);
+    index->count++;
+    return 1;
+}
+
+void removeFromPathIndex(PathIndex *index, Node *node)
+{
+    if (index == NULL || node->song.fileName == NULL)
+        return;
+
+    unsigned int mask = index->size - 1;
+    unsigned int slot = hashSong(&node->song) & mask;
+    while (index->slots[slot] != node)
+    {
+        if (index->slots[slot] == NULL)
+            return;
+        slot = (slot + 1) & mask;
+    }
+
+    // Move back any entry that would become unreachable through the emptied slot
+    unsigned int hole = slot;
+    unsigned int next = (slot + 1) & mask;
+    while (index->slots[next] != NULL)
+    {
+        unsigned int home = hashSong(&index->slots[next]->song) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            index->slots[hole] = index->slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    index->slots[hole] = NULL;
+    index->count--;
+}
@@ -0,0 +1,23 @@
+#ifndef PATHINDEX_H
+#define PATHINDEX_H
+#include "playlist.h"
+
+// Finds the node holding a song by its path, songs are compared by directory id and file name
+typedef struct PathIndex
+{
+    Node **slots;
+    int size;
+    int count;
+} PathIndex;
+
+PathIndex *createPathIndex(PlayList *list);
+
+void freePathIndex(PathIndex *index);
+
+Node *findInPathIndex(PathIndex *index, const SongInfo *song);
+
+int addToPathIndex(PathIndex *index, Node *node);
+
+void removeFromPathIndex(PathIndex *index, Node *node);
+
+#endif
@@ -1,4 +1,6 @@
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "player.h"
 
 const char VERSION[] = "0.9.18";
@@ -15,6 +17,8 @@ bool printInfo = false;
 bool showList = true;
 int aboutHeight = 8;
 int visualizerHeight = 8;
+bool visualizerMeasure = false;
+int visualizerFps = 30;
 int minWidth = 37;
 int minHeight = 2;
 int coverRow = 0;
@@ -28,15 +32,44 @@ PixelData color = {0, 0, 0};
 PixelData bgColor = {50, 50, 50};
 TagSettings metadata = {};
 
-int calcMetadataHeight()
+// Held by whoever writes to the terminal, the main loop and the visualizer thread
+pthread_mutex_t outputMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t visualizerThread;
+static volatile bool visualizerRunning = false;
+static bool playerDrawn = false; // The player view is on screen and the cursor rests on the time row
+static ScreenRegion bottomScreen;  // The time, the spectrum and the last row
+
+/*
+The title is typed out and the last row now and then glimmers. Both are drawn a step at a time by the frames
+that are drawn anyway, how far they are is worked out from the time they started.
+*/
+#define TITLE_CHAR_MS 9      // Per character of the title
+#define TITLE_CURSOR_MS 450  // The block cursor stays this long after the last character
+#define GLIMMER_STEP_MS 15   // Per character the bright spot moves along the last row
+
+typedef struct
+{
+    char text[256];
+    int length;              // Bytes to type, -1 when the title is shown in full
+    int shown;               // Bytes typed so far
+    int rowsAbove;           // From the time row up to the title
+    PixelData color;
+    struct timespec start;
+} TitleAnimation;
+
+static TitleAnimation titleAnimation = {.length = -1};
+static int glimmerRow = 0;   // Row of bottomScreen that glimmers, 0 when none does
+static struct timespec glimmerStart;
+
+int calcMetadataHeight(TagSettings *tags)
 {
     int term_w, term_h;
     getTermSize(&term_w, &term_h);
-    size_t titleLength = strlen(metadata.title);
+    size_t titleLength = strlen(tags->title);
     int titleHeight = (int)ceil((float)titleLength / term_w);
-    size_t artistLength = strlen(metadata.artist);
+    size_t artistLength = strlen(tags->artist);
     int artistHeight = (int)ceil((float)artistLength / term_w);
-    size_t albumLength = strlen(metadata.album);
+    size_t albumLength = strlen(tags->album);
     int albumHeight = (int)ceil((float)albumLength / term_w);
     int yearHeight = 1;
 
@@ -46,7 +79,20 @@ int calcMetadataHeight()
 void calcPreferredSize()
 {
     minHeight = 2 + (visualizerEnabled ? visualizerHeight : 0);
-    calcIdealImgSize(&preferredWidth, &preferredHeight, (visualizerEnabled ? visualizerHeight : 0), calcMetadataHeight());
+    calcIdealImgSize(&preferredWidth, &preferredHeight, (visualizerEnabled ? visualizerHeight : 0), calcMetadataHeight(&metadata));
+}
+
+// Called by the loader, so that changing to the song only has to write out the rendered cover
+void prerenderCover(SongData *songdata)
+{
+    int width, height;
+
+    if (!coverEnabled || songdata == NULL || songdata->cover == NULL || songdata->metadata == NULL)
+        return;
+
+    calcIdealImgSize(&width, &height, (visualizerEnabled ? visualizerHeight : 0), calcMetadataHeight(songdata->metadata));
+    if (width > 0 && height > 0)
+        renderCover(songdata, width, height, coverAnsi);
 }
 
 void printCover(SongData *songdata)
@@ -54,9 +100,7 @@ void printCover(SongData *songdata)
     clearRestOfScreen();
     if (songdata->cover != NULL && coverEnabled)
     {
-        color.r = *(songdata->red);
-        color.g = *(songdata->green);
-        color.b = *(songdata->blue);
+        color = songdata->color;
 
         displayCover(songdata, preferredWidth, preferredHeight, coverAnsi);
 
@@ -91,25 +135,17 @@ void setColor()
     setTextColorRGB2(color.r, color.g, color.b);
 }
 
-void printWithDelay(const char *text, int delay, int maxWidth)
+// The title row is left empty, drawTitle() types it out in the frames that follow
+void startTitleAnimation(const char *text, int maxWidth, int rowsAbove, PixelData color)
 {
     int length = strlen(text);
-    int max = (maxWidth > length) ? length : maxWidth;
-    for (int i = 0; i <= max; i++)
-    {
-        printf("\r ");
-        for (int j = 0; j < i; j++)
-        {
-            printf("%c", text[j]);
-        }
-        printf("█");
-        fflush(stdout);
-        usleep(delay * 1000); // Delay in milliseconds
-    }
-    usleep(delay * 50000);
-    printf("\033[1K\r %.*s", maxWidth, text);
-    printf("\n");
-    fflush(stdout);
+
+    snprintf(titleAnimation.text, sizeof(titleAnimation.text), "%s", text);
+    titleAnimation.length = (maxWidth < length) ? (maxWidth > 0 ? maxWidth : 0) : length;
+    titleAnimation.shown = -1;
+    titleAnimation.rowsAbove = rowsAbove;
+    titleAnimation.color = color;
+    clock_gettime(CLOCK_MONOTONIC, &titleAnimation.start);
 }
 
 void printBasicMetadata(TagSettings *metadata)
@@ -145,20 +181,14 @@ void printBasicMetadata(TagSettings *metadata)
         PixelData pixel = increaseLuminosity(color, 100);
         if (pixel.r == 255 && pixel.g == 255 && pixel.b == 255)
         {
-            PixelData gray;
-            gray.r = 210;
-            gray.g = 210;
-            gray.b = 210;
-            setTextColorRGB2(gray.r, gray.g, gray.b);
+            pixel.r = 210;
+            pixel.g = 210;
+            pixel.b = 210;
         }
-        else
-        {
-            setTextColorRGB2(pixel.r, pixel.g, pixel.b);
-        }
-
-        printWithDelay(metadata->title, 9, maxWidth);
+        startTitleAnimation(metadata->title, maxWidth, rows, pixel);
+        printf("\n");
     }
-    fflush(stdout);
+    flushOutput();
     cursorJumpDown(rows - 1);
 }
 
@@ -171,9 +201,6 @@ void printProgress(double elapsed_seconds, double total_seconds, double total_du
     if (term_w < progressWidth)
         return;
 
-    // Save the current cursor position
-    printf("\033[s");
-
     int elapsed_hours = (int)(elapsed_seconds / 3600);
     int elapsed_minutes = (int)(((int)elapsed_seconds / 60) % 60);
     int elapsed_seconds_remainder = (int)elapsed_seconds % 60;
@@ -187,37 +214,34 @@ void printProgress(double elapsed_seconds, double total_seconds, double total_du
     int total_playlist_hours = (int)(total_duration_seconds / 3600);
     int total_playlist_minutes = (int)(((int)total_duration_seconds / 60) % 60);
 
-    // Clear the current line
-    printf("\033[K");
-    printf("\r");
+    char text[100];
 
     if (playlist->count <= MAX_COUNT_PLAYLIST_SONGS)
     {
-        printf(" %02d:%02d:%02d / %02d:%02d:%02d (%d%%) T:%dh%02dm",
-                elapsed_hours, elapsed_minutes, elapsed_seconds_remainder,
-                total_hours, total_minutes, total_seconds_remainder,
-                progress_percentage, total_playlist_hours, total_playlist_minutes);
+        snprintf(text, sizeof(text), " %02d:%02d:%02d / %02d:%02d:%02d (%d%%) T:%dh%02dm",
+                 elapsed_hours, elapsed_minutes, elapsed_seconds_remainder,
+                 total_hours, total_minutes, total_seconds_remainder,
+                 progress_percentage, total_playlist_hours, total_playlist_minutes);
     }
     else
     {
-         printf(" %02d:%02d:%02d / %02d:%02d:%02d (%d%%)",
-                elapsed_hours, elapsed_minutes, elapsed_seconds_remainder,
-                total_hours, total_minutes, total_seconds_remainder,
-                progress_percentage);       
+        snprintf(text, sizeof(text), " %02d:%02d:%02d / %02d:%02d:%02d (%d%%)",
+                 elapsed_hours, elapsed_minutes, elapsed_seconds_remainder,
+                 total_hours, total_minutes, total_seconds_remainder,
+                 progress_percentage);
     }
 
-    fflush(stdout);
-
-    // Restore the cursor position
-    printf("\033[u");
-    fflush(stdout);
+    // Drawn in the colour setColor() would use
+    PixelData textColor = color;
+    if (color.r == 255 && color.g == 255 && color.b == 255)
+        textColor.r = textColor.g = textColor.b = 210;
+    screenPrint(&bottomScreen, 0, 0, text, textColor, color.r == 0 && color.g == 0 && color.b == 0);
 }
 
 void printMetadata(TagSettings *metadata)
 {
     if (!metaDataEnabled || printInfo)
         return;
-    usleep(100000);
     setColor();
     printBasicMetadata(metadata);
 }
@@ -226,9 +250,9 @@ void printTime(PlayList *playlist)
 {
     if (!timeEnabled || printInfo)
         return;
-    setColor();
     int term_w, term_h;
     getTermSize(&term_w, &term_h);
+    screenClearRow(&bottomScreen, 0);
     if (term_h > minHeight && term_w > minWidth)
         printProgress(elapsed, duration, totalDurationSeconds, playlist);
 }
@@ -238,42 +262,6 @@ int getRandomNumber(int min, int max)
     return min + rand() % (max - min + 1);
 }
 
-void printGlimmeringText(char *text, PixelData color)
-{
-    int textLength = strlen(text);
-    int brightIndex = 0;
-
-    PixelData vbright = increaseLuminosity(color, 160);
-    PixelData bright = increaseLuminosity(color, 60);
-
-    while (brightIndex < textLength)
-    {
-        for (int i = 0; i < textLength; i++)
-        {
-            if (i == brightIndex)
-            {
-                setTextColorRGB2(vbright.r, vbright.g, vbright.b);
-                printf("%c", text[i]);
-            }
-            else if (i == brightIndex - 1 || i == brightIndex + 1)
-            {
-                setTextColorRGB2(bright.r, bright.g, bright.b);
-                printf("%c", text[i]);
-            }
-            else
-            {
-                setTextColorRGB2(color.r, color.g, color.b);
-                printf("%c", text[i]);
-            }
-
-            fflush(stdout);
-            usleep(30);
-        }
-        brightIndex++;
-        printf("\r");
-    }
-}
-
 void printLastRow()
 {
     int term_w, term_h;
@@ -290,11 +278,31 @@ void printLastRow()
         strcpy(versionPtr, VERSION);
     }
 
-    int randomNumber = getRandomNumber(1, 808);
-    if (randomNumber == 808)
-        printGlimmeringText(text, bgColor);
-    else
-        printf("%s", text);
+    printf("%s", text);
+}
+
+// The last row of the player view, a glimmer that runs is put over it by putGlimmer()
+void putLastRow(int row)
+{
+    int term_w, term_h;
+    getTermSize(&term_w, &term_h);
+    screenClearRow(&bottomScreen, row);
+    if (term_w < minWidth)
+        return;
+
+    char text[100];
+    snprintf(text, sizeof(text), " [F1 Playlist] [Q Quit] cue v%s", VERSION);
+    screenPrint(&bottomScreen, row, 0, text, bgColor, false);
+
+    if (glimmerRow > 0)
+    {
+        glimmerRow = row;
+    }
+    else if (getRandomNumber(1, 808) == 808)
+    {
+        glimmerRow = row;
+        clock_gettime(CLOCK_MONOTONIC, &glimmerStart);
+    }
 }
 
 void showVersion()
@@ -349,8 +357,8 @@ void shortenString(char *str, size_t width)
 
 int showPlaylist()
 {
-    Node *node = playlist.head;
-    Node *foundNode = playlist.head;
+    Node *node = getPlayListFirst(&playlist);
+    Node *foundNode = node;
     bool foundCurrentSong = false;
     bool startFromCurrent = false;
     int term_w, term_h;
@@ -366,7 +374,6 @@ int showPlaylist()
     printf("\n");
     numRows++;
     numPrintedRows++;
-    usleep(700000);
     PixelData textColor = increaseLuminosity(color, 100);
     setTextColorRGB2(textColor.r, textColor.g, textColor.b);
     printAbout();
@@ -376,12 +383,12 @@ int showPlaylist()
     int numSongs = 0;
     for (int i = 0; i < playlist.count; i++)
     {
-        if (strcmp(node->song.filePath, currentSong->song.filePath) == 0)
+        if (node == currentSong)
         {
             foundAt = numSongs;
             foundNode = node;
         }
-        node = node->next;
+        node = getPlayListNext(&playlist, node);
         numSongs++;
         if (numSongs > maxListSize)
         {
@@ -393,25 +400,22 @@ int showPlaylist()
     if (startFromCurrent)
         node = foundNode;
     else
-        node = playlist.head;
+        node = getPlayListFirst(&playlist);
 
     for (int i = (startFromCurrent ? foundAt : 0); i < (startFromCurrent ? foundAt : 0) + maxListSize; i++)
     {
         if (node == NULL)
             break;
-        char filePath[MAXPATHLEN];
-        strcpy(filePath, node->song.filePath);
-        char *lastSlash = strrchr(filePath, '/');
-        char *lastDot = strrchr(filePath, '.');
+        const char *fileName = node->song.fileName;
+        const char *lastDot = strrchr(fileName, '.');
         printf("\r");
         setTextColorRGB2(color.r, color.g, color.b);
-        if (lastSlash != NULL && lastDot != NULL && lastDot > lastSlash)
+        if (lastDot != NULL)
         {
             char copiedString[256];
-            strncpy(copiedString, lastSlash + 1, lastDot - lastSlash - 1);
-            copiedString[lastDot - lastSlash - 1] = '\0';
+            snprintf(copiedString, sizeof(copiedString), "%.*s", (int)(lastDot - fileName), fileName);
             removeUnneededChars(copiedString);
-            if (strcmp(filePath, currentSong->song.filePath) == 0)
+            if (node == currentSong)
             {
                 setTextColorRGB2(textColor.r, textColor.g, textColor.b);
                 foundCurrentSong = true;
@@ -434,7 +438,7 @@ int showPlaylist()
 
             setTextColorRGB2(color.r, color.g, color.b);
         }
-        node = node->next;
+        node = getPlayListNext(&playlist, node);
     }
     printf("\n");
     printLastRow();
@@ -451,29 +455,115 @@ int showPlaylist()
     return numPrintedRows;
 }
 
+int getBottomRows()
+{
+    return visualizerEnabled ? visualizerHeight + 3 : 3;
+}
+
+// The rows from the time down to the last row, the cursor rests on the time row
+void prepareBottomScreen()
+{
+    int term_w, term_h;
+    getTermSize(&term_w, &term_h);
+
+    int rows = getBottomRows();
+    if (refresh)
+    {
+        // Makes room below the cursor, scrolling when the rows aren't there yet
+        for (int i = 1; i < rows; i++)
+            printf("\n");
+        cursorJump(rows - 1);
+        screenInvalidate(&bottomScreen);
+    }
+    screenResize(&bottomScreen, term_w, rows);
+}
+
+long elapsedMilliseconds(const struct timespec *from)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000L + (now.tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+// A bright spot that moves along the last row, with a less bright character on either side
+void putGlimmer()
+{
+    if (glimmerRow <= 0)
+        return;
+
+    char text[100];
+    snprintf(text, sizeof(text), " [F1 Playlist] [Q Quit] cue v%s", VERSION);
+    int length = strlen(text);
+    int brightIndex = (int)(elapsedMilliseconds(&glimmerStart) / GLIMMER_STEP_MS);
+
+    PixelData vbright = increaseLuminosity(bgColor, 160);
+    PixelData bright = increaseLuminosity(bgColor, 60);
+
+    for (int i = 0; i < length; i++)
+    {
+        char glyph[2] = {text[i], '\0'};
+        PixelData cellColor = bgColor;
+
+        if (i == brightIndex)
+            cellColor = vbright;
+        else if (i == brightIndex - 1 || i == brightIndex + 1)
+            cellColor = bright;
+        screenPut(&bottomScreen, glimmerRow, i, glyph, cellColor, false);
+    }
+
+    if (brightIndex > length)
+        glimmerRow = 0;
+}
+
+// Types the title as far as it has got, the cursor rests on the time row before and after
+void drawTitle()
+{
+    if (titleAnimation.length < 0)
+        return;
+
+    long milliseconds = elapsedMilliseconds(&titleAnimation.start);
+    int typed = (int)(milliseconds / TITLE_CHAR_MS);
+    bool finished = milliseconds >= (long)titleAnimation.length * TITLE_CHAR_MS + TITLE_CURSOR_MS;
+
+    if (typed > titleAnimation.length)
+        typed = titleAnimation.length;
+    if (typed == titleAnimation.shown && !finished)
+        return;
+
+    printf("\033[%dA\r", titleAnimation.rowsAbove);
+    setTextColorRGB2(titleAnimation.color.r, titleAnimation.color.g, titleAnimation.color.b);
+    printf(" %.*s%s\033[K", typed, titleAnimation.text, finished ? "" : "█");
+    printf("\033[%dB\r\033[0m", titleAnimation.rowsAbove);
+
+    titleAnimation.shown = typed;
+    if (finished)
+        titleAnimation.length = -1;
+}
+
+bool isAnimating()
+{
+    return glimmerRow > 0 || titleAnimation.length >= 0;
+}
+
+void flushBottomScreen()
+{
+    putGlimmer();
+    screenFlush(&bottomScreen);
+    drawTitle();
+}
+
 void printEqualizer()
 {
     if (visualizerEnabled && !printInfo)
     {
-        printf("\n");
         int term_w, term_h;
         getTermSize(&term_w, &term_h);
-        drawSpectrumVisualizer(visualizerHeight, term_w, color);
-        printLastRow();
-        int jumpAmount = visualizerHeight + 2;
-        cursorJump(jumpAmount);
-        saveCursorPosition();
+        drawSpectrumVisualizer(&bottomScreen, 2, visualizerHeight, term_w, color);
+        putLastRow(visualizerHeight + 2);
     }
     else if (!visualizerEnabled)
     {
-        int term_w, term_h;
-        getTermSize(&term_w, &term_h);
-        if (term_w >= minWidth)
-        {
-            printf("\n\n");
-            printLastRow();
-            cursorJump(2);
-        }
+        putLastRow(2);
     }
 }
 
@@ -488,7 +578,10 @@ int printPlayer(SongData *songdata, double elapsedSeconds, PlayList *playlist)
     calcPreferredSize();
 
     if (preferredWidth <= 0 || preferredHeight <= 0)
+    {
+        playerDrawn = false;
         return -1;
+    }
 
     if (printInfo)
     {
@@ -508,14 +601,108 @@ int printPlayer(SongData *songdata, double elapsedSeconds, PlayList *playlist)
             printCover(songdata);
             printMetadata(songdata->metadata);
         }
+        prepareBottomScreen();
         printTime(playlist);
-        printEqualizer();
+
+        // Between refreshes the visualizer thread draws the spectrum
+        if (refresh || !visualizerEnabled)
+            printEqualizer();
+        flushBottomScreen();
     }
+    playerDrawn = !printInfo;
     refresh = false;
-    fflush(stdout);
+    flushOutput();
     return 0;
 }
 
+long elapsedNanoseconds(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+void addNanoseconds(struct timespec *time, long nanoseconds)
+{
+    time->tv_sec += nanoseconds / 1000000000L;
+    time->tv_nsec += nanoseconds % 1000000000L;
+    if (time->tv_nsec >= 1000000000L)
+    {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+Draws the spectrum and the animations visualizerFps times a second, apart from the main loop. A frame may take as long as the
+time between two frames. When the terminal can't keep up, frames that were missed are dropped and the
+interval is doubled, down to VISUALIZER_MIN_FPS, and it creeps back once frames are fast again.
+*/
+void *runVisualizer(void *arg)
+{
+    (void)arg;
+    int fps = (visualizerFps < VISUALIZER_MIN_FPS) ? VISUALIZER_MIN_FPS : (visualizerFps > VISUALIZER_MAX_FPS ? VISUALIZER_MAX_FPS : visualizerFps);
+    long targetInterval = 1000000000L / fps;
+    long longestInterval = 1000000000L / VISUALIZER_MIN_FPS;
+    long interval = targetInterval;
+    struct timespec next, start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (visualizerRunning)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pthread_mutex_lock(&outputMutex);
+        bool drawSpectrum = visualizerEnabled && !isPaused();
+        if (playerDrawn && !printInfo && !refresh && (drawSpectrum || isAnimating()))
+        {
+            beginFrame();
+            if (drawSpectrum)
+                printEqualizer();
+            flushBottomScreen();
+            endFrame();
+        }
+        pthread_mutex_unlock(&outputMutex);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long took = elapsedNanoseconds(&start, &end);
+
+        if (took > interval)
+            interval = (interval * 2 < longestInterval) ? interval * 2 : longestInterval;
+        else if (took < interval / 2 && interval > targetInterval)
+            interval = (interval - interval / 8 > targetInterval) ? interval - interval / 8 : targetInterval;
+
+        addNanoseconds(&next, interval);
+        if (elapsedNanoseconds(&end, &next) < 0)
+        {
+            next = end;
+            addNanoseconds(&next, interval);
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+void startVisualizer()
+{
+    if (visualizerRunning)
+        return;
+
+    visualizerRunning = true;
+    if (pthread_create(&visualizerThread, NULL, runVisualizer, NULL) != 0)
+        visualizerRunning = false;
+}
+
+void stopVisualizer()
+{
+    if (!visualizerRunning)
+        return;
+
+    visualizerRunning = false;
+    pthread_join(visualizerThread, NULL);
+    playerDrawn = false;
+    freeScreen(&bottomScreen);
+}
+
 void showHelp()
 {
     printHelp();
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "albumart.h"
 #include "term.h"
 #include "printfunc.h"
@@ -12,6 +13,9 @@
 #include "playlist.h"
 #include "songloader.h"
 
+#define VISUALIZER_MIN_FPS 5
+#define VISUALIZER_MAX_FPS 120
+
 extern const char VERSION[];
 
 extern bool coverEnabled;
@@ -20,11 +24,19 @@ extern bool printInfo;
 extern bool visualizerEnabled;
 extern bool useThemeColors;
 extern int visualizerHeight;
+extern int visualizerFps;
+extern pthread_mutex_t outputMutex;
 extern volatile bool refresh;
 extern TagSettings metadata;
 
 int printPlayer(SongData *songdata, double elapsedSeconds, PlayList *playlist);
 
+void prerenderCover(SongData *songdata);
+
+void startVisualizer();
+
+void stopVisualizer();
+
 void showVersion();
 
 void printAbout();
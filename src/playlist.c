@@ -5,19 +5,31 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "playlist.h"
 #include "file.h"
 #include "stringfunc.h"
 #include "settings.h"
+#include "query.h"
+#include "dirscan.h"
+#include "stringpool.h"
+#include "pathindex.h"
 
 #define MAX_SEARCH_SIZE 256
-#define MAX_FILES 10000
+#define MIN_MAIN_PLAYLIST_CHANGES_TO_COMPACT 128
 
 const char ALLOWED_EXTENSIONS[] = "\\.(m4a|mp3|ogg|flac|wav|aac|wma|raw|mp4a|mp4)$";
-const char PLAYLIST_EXTENSIONS[] = "\\.(m3u)$";
+const char PLAYLIST_EXTENSIONS[] = "\\.(m3u|m3u8)$";
 const char mainPlaylistName[] = "cue.m3u";
-PlayList playlist = {NULL, NULL, 0, 0.0};
+const char mainPlaylistLogName[] = "cue.m3u.log";
+PlayList playlist = {NULL, NULL, 0, 0.0, NULL, 0, 0, NULL, {false, 0, 0, 0, 0}, NULL, NULL};
 PlayList *mainPlaylist = NULL;
+char mainPlaylistPath[MAXPATHLEN];
+char mainPlaylistLogPath[MAXPATHLEN];
+int numMainPlaylistChanges = 0;
 
 char search[MAX_SEARCH_SIZE];
 char playlistName[MAX_SEARCH_SIZE];
@@ -36,15 +48,171 @@ Node *getListPrev(Node *node)
     return (node == NULL) ? NULL : node->prev;
 }
 
+/*
+Nodes live in fixed size chunks owned by the playlist, so they never move once added and
+prev, next and currentSong stay valid through shuffles. The slot of a deleted song is reused
+by the next song added. Paths are split into a directory, stored once for all the songs in it,
+and a file name kept in the string pool. A playlist owns a reference to the strings of its songs.
+*/
+// Gives the playlist its own copy of nodes it shares with other playlists, before it changes them
+int detachListNodes(PlayList *list)
+{
+    if (list->shareCount == NULL)
+        return 0;
+
+    if (*list->shareCount == 1)
+    {
+        free(list->shareCount);
+        list->shareCount = NULL;
+        return 0;
+    }
+
+    Node **chunks = calloc(list->numChunks > 0 ? list->numChunks : 1, sizeof(Node *));
+    if (chunks == NULL)
+        return -1;
+
+    for (int i = 0; i < list->numChunks; i++)
+    {
+        chunks[i] = malloc(PLAYLIST_CHUNK_SIZE * sizeof(Node));
+        if (chunks[i] == NULL)
+        {
+            for (int j = 0; j < i; j++)
+                free(chunks[j]);
+            free(chunks);
+            return -1;
+        }
+        memcpy(chunks[i], list->chunks[i], PLAYLIST_CHUNK_SIZE * sizeof(Node));
+    }
+
+    // Links point into the shared chunks, so they are moved over by index
+#define DETACHED_NODE(node) ((node) == NULL ? NULL : &chunks[(node)->index >> PLAYLIST_CHUNK_BITS][(node)->index & (PLAYLIST_CHUNK_SIZE - 1)])
+    for (int i = 0; i < list->numNodes; i++)
+    {
+        Node *node = &chunks[i >> PLAYLIST_CHUNK_BITS][i & (PLAYLIST_CHUNK_SIZE - 1)];
+        node->next = DETACHED_NODE(node->next);
+        node->prev = DETACHED_NODE(node->prev);
+        retainSongInfo(&node->song);
+    }
+    list->head = DETACHED_NODE(list->head);
+    list->tail = DETACHED_NODE(list->tail);
+    list->freeNodes = DETACHED_NODE(list->freeNodes);
+#undef DETACHED_NODE
+
+    (*list->shareCount)--;
+    list->shareCount = NULL;
+    list->chunks = chunks;
+
+    if (list->index != NULL)
+    {
+        freePathIndex(list->index);
+        list->index = createPathIndex(list);
+    }
+    return 0;
+}
+
+Node *newListNode(PlayList *list)
+{
+    if (detachListNodes(list) < 0)
+        return NULL;
+
+    if (list->freeNodes != NULL)
+    {
+        Node *node = list->freeNodes;
+        list->freeNodes = node->next;
+        return node;
+    }
+
+    int chunk = list->numNodes >> PLAYLIST_CHUNK_BITS;
+
+    if (chunk == list->numChunks)
+    {
+        Node **chunks = realloc(list->chunks, (list->numChunks + 1) * sizeof(Node *));
+        if (chunks == NULL)
+            return NULL;
+        list->chunks = chunks;
+
+        list->chunks[chunk] = malloc(PLAYLIST_CHUNK_SIZE * sizeof(Node));
+        if (list->chunks[chunk] == NULL)
+            return NULL;
+        list->numChunks++;
+    }
+
+    Node *node = &list->chunks[chunk][list->numNodes & (PLAYLIST_CHUNK_SIZE - 1)];
+    node->index = list->numNodes++;
+    return node;
+}
+
+// Returns the node in a slot, the slots of deleted songs included (their fileName is NULL)
+Node *getListNodeAt(PlayList *list, int index)
+{
+    if (list == NULL || index < 0 || index >= list->numNodes)
+        return NULL;
+    return &list->chunks[index >> PLAYLIST_CHUNK_BITS][index & (PLAYLIST_CHUNK_SIZE - 1)];
+}
+
+SongInfo makeSongInfo(const char *filePath, double duration)
+{
+    SongInfo song;
+    const char *lastSlash = strrchr(filePath, '/');
+
+    if (lastSlash != NULL)
+    {
+        song.dirId = internDirectory(filePath, lastSlash - filePath);
+        song.fileName = poolStrdup(lastSlash + 1);
+    }
+    else
+    {
+        song.dirId = -1;
+        song.fileName = poolStrdup(filePath);
+    }
+    song.duration = duration;
+    song.title = NULL;
+    return song;
+}
+
+char *getSongPath(const SongInfo *song, char *buffer, size_t size)
+{
+    const char *directory = getInternedDirectory(song->dirId);
+
+    if (song->fileName == NULL)
+        snprintf(buffer, size, "%s", "");
+    else if (directory != NULL)
+        snprintf(buffer, size, "%s/%s", directory, song->fileName);
+    else
+        snprintf(buffer, size, "%s", song->fileName);
+    return buffer;
+}
+
+void retainSongInfo(SongInfo *song)
+{
+    poolRetain(song->fileName);
+    poolRetain(song->title);
+}
+
+void releaseSongInfo(SongInfo *song)
+{
+    poolRelease(song->fileName);
+    poolRelease(song->title);
+    song->fileName = NULL;
+    song->title = NULL;
+}
+
+// The playlist takes over the song's references to its strings, retain them first to keep using them
 void addToList(PlayList *list, SongInfo song)
 {
-    if (list->count >= MAX_FILES)
+    Node *newNode = newListNode(list);
+    if (newNode == NULL)
+    {
+        releaseSongInfo(&song);
         return;
-    Node *newNode = (Node *)malloc(sizeof(Node));
+    }
     newNode->song = song;
     newNode->next = NULL;
     list->count++;
 
+    if (list->index != NULL)
+        addToPathIndex(list->index, newNode);
+
     if (list->head == NULL)
     {
         newNode->prev = NULL;
@@ -59,11 +227,29 @@ void addToList(PlayList *list, SongInfo song)
     }
 }
 
+void addPathToList(PlayList *list, const char *filePath, double duration)
+{
+    SongInfo song = makeSongInfo(filePath, duration);
+    if (song.fileName != NULL)
+        addToList(list, song);
+}
+
+// Returns the song played after the deleted one
 Node *deleteFromList(PlayList *list, Node *node)
 {
     if (list->head == NULL || node == NULL)
         return NULL;
 
+    if (list->shareCount != NULL)
+    {
+        int index = node->index;
+        if (detachListNodes(list) < 0)
+            return NULL;
+        node = getListNodeAt(list, index);
+    }
+
+    Node *nextNode = getPlayListNext(list, node);
+
     if (node == list->head)
         list->head = node->next;
     if (node == list->tail)
@@ -74,9 +260,12 @@ Node *deleteFromList(PlayList *list, Node *node)
     if (node->next != NULL)
         node->next->prev = node->prev;
 
-    Node *nextNode = node->next;
+    removeFromPathIndex(list->index, node);
 
-    free(node);
+    releaseSongInfo(&node->song);
+    node->next = list->freeNodes;
+    node->prev = NULL;
+    list->freeNodes = node;
     list->count--;
     return nextNode;
 }
@@ -86,99 +275,199 @@ void deletePlaylist(PlayList *list)
     if (list == NULL)
         return;
 
-    Node *current = list->head;
-    while (current != NULL)
+    if (list->shareCount != NULL && *list->shareCount > 1)
+    {
+        (*list->shareCount)--;
+    }
+    else
     {
-        Node *next = current->next;
-        if (current->song.filePath != NULL)
-            free(current->song.filePath);
-        free(current);
-        current = next;
+        for (int i = 0; i < list->numNodes; i++)
+            releaseSongInfo(&getListNodeAt(list, i)->song);
+        for (int i = 0; i < list->numChunks; i++)
+            free(list->chunks[i]);
+        free(list->chunks);
+        free(list->shareCount);
     }
+    freePathIndex(list->index);
 
     // Reset the playlist
     list->head = NULL;
     list->tail = NULL;
     list->count = 0;
     list->totalDuration = 0.0;
+    list->chunks = NULL;
+    list->numChunks = 0;
+    list->numNodes = 0;
+    list->shareCount = NULL;
+    list->shuffle.enabled = false;
+    list->index = NULL;
+    list->freeNodes = NULL;
 }
 
-void shufflePlaylist(PlayList *playlist)
+/*
+Shuffling doesn't move anything. The play order is a permutation of the node indexes made with a
+small Feistel network keyed by the seed. Indexes that fall outside the playlist are run through
+it again until they land inside (cycle walking), so it stays a permutation for any size.
+Going forwards or backwards from a song takes a couple of rounds, whatever the playlist size.
+*/
+#define FEISTEL_ROUNDS 4
+
+unsigned int feistelRound(unsigned int value, unsigned int seed, int round)
 {
-    if (playlist == NULL || playlist->count <= 1)
-    {
-        return; // No need to shuffle
-    }
+    unsigned int hash = value ^ (seed + 0x9e3779b9u * (round + 1));
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68bu;
+    hash ^= hash >> 16;
+    return hash;
+}
 
-    // Convert the linked list to an array
-    Node **nodes = (Node **)malloc(playlist->count * sizeof(Node *));
-    if (nodes == NULL)
-    {
-        printf("Memory allocation error.\n");
-        exit(0);
-    }
+unsigned int feistelPermute(unsigned int value, const ShuffleOrder *order, bool inverse)
+{
+    unsigned int mask = (1u << order->halfBits) - 1;
+    unsigned int left = value >> order->halfBits;
+    unsigned int right = value & mask;
 
-    Node *current = playlist->head;
-    int i = 0;
-    while (current != NULL)
+    for (int i = 0; i < FEISTEL_ROUNDS; i++)
     {
-        nodes[i++] = current;
-        current = current->next;
+        if (inverse)
+        {
+            unsigned int prevRight = left;
+            left = right ^ (feistelRound(left, order->seed, FEISTEL_ROUNDS - 1 - i) & mask);
+            right = prevRight;
+        }
+        else
+        {
+            unsigned int nextLeft = right;
+            right = left ^ (feistelRound(right, order->seed, i) & mask);
+            left = nextLeft;
+        }
     }
+    return (left << order->halfBits) | right;
+}
 
-    // Shuffle the array using Fisher-Yates algorithm
-    srand(time(NULL));
-    for (int j = playlist->count - 1; j >= 1; --j)
-    {
-        int k = rand() % (j + 1);
-        Node *temp = nodes[j];
-        nodes[j] = nodes[k];
-        nodes[k] = temp;
-    }
-    playlist->head = nodes[0];
-    playlist->tail = nodes[playlist->count - 1];
-    for (int j = 0; j < playlist->count; ++j)
+unsigned int permuteIndex(unsigned int value, const ShuffleOrder *order, bool inverse)
+{
+    do
     {
-        nodes[j]->next = (j < playlist->count - 1) ? nodes[j + 1] : NULL;
-        nodes[j]->prev = (j > 0) ? nodes[j - 1] : NULL;
-    }
-    free(nodes);
+        value = feistelPermute(value, order, inverse);
+    } while (value >= (unsigned int)order->size);
+
+    return value;
 }
 
-void insertAsFirst(Node *currentSong, PlayList *playlist)
+// Songs added after the shuffle are played in the order they were added, after the shuffled ones.
+// A song that reuses the slot of a deleted one takes its place in the order instead.
+Node *getNodeAtPosition(PlayList *list, int position)
 {
-    if (currentSong == NULL || playlist == NULL)
-    {
+    const ShuffleOrder *order = &list->shuffle;
+
+    if (position < 0 || position >= list->numNodes)
+        return NULL;
+    if (!order->enabled || position >= order->size)
+        return getListNodeAt(list, position);
+
+    return getListNodeAt(list, permuteIndex((position + order->offset) % order->size, order, false));
+}
+
+int getNodePosition(PlayList *list, Node *node)
+{
+    const ShuffleOrder *order = &list->shuffle;
+
+    if (!order->enabled || node->index >= order->size)
+        return node->index;
+
+    int position = (int)permuteIndex(node->index, order, true) - order->offset;
+    return (position < 0) ? position + order->size : position;
+}
+
+// Deleted songs are skipped
+Node *findPlayableNode(PlayList *list, int position, int step)
+{
+    Node *node;
+    while ((node = getNodeAtPosition(list, position)) != NULL && node->song.fileName == NULL)
+        position += step;
+    return node;
+}
+
+Node *getPlayListFirst(PlayList *list)
+{
+    if (list == NULL || !list->shuffle.enabled)
+        return (list == NULL) ? NULL : list->head;
+
+    return findPlayableNode(list, 0, 1);
+}
+
+Node *getPlayListNext(PlayList *list, Node *node)
+{
+    if (list == NULL || node == NULL || !list->shuffle.enabled)
+        return getListNext(node);
+
+    return findPlayableNode(list, getNodePosition(list, node) + 1, 1);
+}
+
+// Like getPlayListNext, but at the end of a playlist that is still being built it takes a song the scan has found.
+// It doesn't wait, NULL can also mean none was found yet, see isPlayListNextPending().
+Node *drawPlayListNext(PlayList *list, Node *node)
+{
+    Node *next = getPlayListNext(list, node);
+
+    while (next == NULL && node != NULL && isPlaylistGrowing(list) && drawPendingSongs(list))
+        next = getPlayListNext(list, node);
+
+    return next;
+}
+
+// True when there is no next song yet, but the scan may still find one
+bool isPlayListNextPending(PlayList *list, Node *node)
+{
+    return node != NULL && getPlayListNext(list, node) == NULL && isPlaylistGrowing(list);
+}
+
+Node *getPlayListPrev(PlayList *list, Node *node)
+{
+    if (list == NULL || node == NULL || !list->shuffle.enabled)
+        return getListPrev(node);
+
+    return findPlayableNode(list, getNodePosition(list, node) - 1, -1);
+}
+
+// The same seed always gives the same order, song (if not NULL) is played first
+void shufflePlaylistWithSeed(PlayList *playlist, Node *song, unsigned int seed)
+{
+    ShuffleOrder *order;
+
+    if (playlist == NULL)
         return;
-    }
 
-    if (playlist->head == NULL)
-    {
-        // The playlist is empty, so the currentSong will be both the head and tail
-        currentSong->next = NULL;
-        currentSong->prev = NULL;
-        playlist->head = currentSong;
-        playlist->tail = currentSong;
-    }
-    else
-    {
-        if (currentSong->next != NULL)
-            currentSong->next->prev = currentSong->prev;
-        if (currentSong->prev != NULL)
-            currentSong->prev->next = currentSong->next;
+    order = &playlist->shuffle;
+    order->enabled = false;
 
-        // Add the currentSong as the new head
-        currentSong->next = playlist->head;
-        currentSong->prev = NULL;
-        playlist->head->prev = currentSong;
-        playlist->head = currentSong;
-    }
+    if (playlist->numNodes <= 1)
+        return;
+
+    order->seed = seed;
+    order->size = playlist->numNodes;
+    order->offset = 0;
+    order->halfBits = 1;
+    while (((unsigned long long)1 << (order->halfBits * 2)) < (unsigned long long)order->size)
+        order->halfBits++;
+
+    if (song != NULL && song->index < order->size)
+        order->offset = (int)permuteIndex(song->index, order, true);
+
+    order->enabled = true;
+}
+
+void shufflePlaylist(PlayList *playlist)
+{
+    shufflePlaylistWithSeed(playlist, NULL, (unsigned int)time(NULL) ^ (unsigned int)rand());
 }
 
 void shufflePlaylistStartingFromSong(PlayList *playlist, Node *song)
 {
-    shufflePlaylist(playlist);
-    insertAsFirst(song, playlist);
+    shufflePlaylistWithSeed(playlist, song, (unsigned int)time(NULL) ^ (unsigned int)rand());
 }
 
 int compare(const struct dirent **a, const struct dirent **b)
@@ -198,85 +487,241 @@ int compare(const struct dirent **a, const struct dirent **b)
     return strcmp(nameA, nameB);
 }
 
+int appendScannedSongs(ScanDir *dir, PlayList *playlist)
+{
+    int songCount = playlist->count;
+    int dirId = -1;
+
+    for (int i = 0; i < dir->numEntries; i++)
+    {
+        ScanEntry *entry = &dir->entries[i];
+
+        if (entry->dir != NULL)
+        {
+            if (appendScannedSongs(entry->dir, playlist) > 0)
+                numDirs++;
+        }
+        else
+        {
+            SongInfo song;
+            if (dirId < 0)
+                dirId = internDirectory(dir->path, strlen(dir->path));
+            song.dirId = dirId;
+            song.fileName = poolStrdup(entry->name);
+            song.duration = 0.0;
+            song.title = NULL;
+            if (song.fileName != NULL)
+                addToList(playlist, song);
+        }
+    }
+    return playlist->count - songCount;
+}
+
 void buildPlaylistRecursive(char *directoryPath, const char *allowedExtensions, PlayList *playlist)
 {
     int res = isDirectory(directoryPath);
     if (res != 1 && res != -1 && directoryPath != NULL)
     {
-        SongInfo song;
-        song.filePath = strdup(directoryPath);
-        song.duration = 0.0;
-        addToList(playlist, song);
+        addPathToList(playlist, directoryPath, 0.0);
         return;
     }
 
-    DIR *dir = opendir(directoryPath);
-    if (dir == NULL)
+    ScanDir *root = scanDirectoryTree(directoryPath, allowedExtensions);
+    if (root == NULL)
     {
         printf("Failed to open directory: %s\n", directoryPath);
         return;
     }
 
-    regex_t regex;
-    int ret = regcomp(&regex, allowedExtensions, REG_EXTENDED);
-    if (ret != 0)
+    int unreadable = countUnreadableDirs(root);
+    if (unreadable > 0)
+        printf("Could not read %d %s in: %s\n", unreadable, (unreadable == 1) ? "directory" : "directories", directoryPath);
+
+    appendScannedSongs(root, playlist);
+    freeScanTree(root);
+}
+
+/*
+Playing the whole library doesn't wait for the scan. The scanning threads hand over each directory's
+songs as soon as it has been read, and the player draws a random one of those found so far every time
+it needs the next song. When the scan is done, the remaining songs are added in random order.
+Only the main thread touches the playlist itself; the scanning threads only fill the pending array.
+*/
+typedef struct
+{
+    PlayList *list;
+    SongInfo *songs;
+    int count;
+    int capacity;
+    bool running;
+    bool done;
+    bool stop;
+    char *path;
+    const char *allowedExtensions;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} PlaylistProducer;
+
+static PlaylistProducer producer = {NULL, NULL, 0, 0, false, false, false, NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+bool addScannedDirectory(const ScanDir *dir, void *data)
+{
+    PlaylistProducer *state = (PlaylistProducer *)data;
+    int dirId = -1;
+    bool keepScanning;
+
+    pthread_mutex_lock(&state->mutex);
+    for (int i = 0; i < dir->numEntries && !state->stop; i++)
     {
-        printf("Failed to compile regular expression\n");
-        closedir(dir);
-        return;
+        if (dir->entries[i].dir != NULL)
+            continue;
+
+        if (state->count == state->capacity)
+        {
+            int capacity = state->capacity > 0 ? state->capacity * 2 : 1024;
+            SongInfo *songs = realloc(state->songs, capacity * sizeof(SongInfo));
+            if (songs == NULL)
+                break;
+            state->songs = songs;
+            state->capacity = capacity;
+        }
+
+        SongInfo *song = &state->songs[state->count];
+        if (dirId < 0)
+            dirId = internDirectory(dir->path, strlen(dir->path));
+        song->dirId = dirId;
+        song->fileName = poolStrdup(dir->entries[i].name);
+        song->duration = 0.0;
+        song->title = NULL;
+        if (song->fileName != NULL)
+            state->count++;
     }
+    pthread_cond_broadcast(&state->cond);
+    keepScanning = !state->stop;
+    pthread_mutex_unlock(&state->mutex);
 
-    char exto[6];
-    struct dirent **entries;
-    int numEntries = scandir(directoryPath, &entries, NULL, compare);
+    return keepScanning;
+}
 
-    if (numEntries < 0)
+void *playlistProducerThread(void *arg)
+{
+    PlaylistProducer *state = (PlaylistProducer *)arg;
+
+    ScanDir *root = scanDirectoryTreeWithCallback(state->path, state->allowedExtensions, addScannedDirectory, state);
+    freeScanTree(root);
+
+    pthread_mutex_lock(&state->mutex);
+    state->done = true;
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->mutex);
+
+    return NULL;
+}
+
+int startPlaylistProducer(const char *directoryPath, const char *allowedExtensions, PlayList *list)
+{
+    if (producer.running)
+        return -1;
+
+    producer.path = strdup(directoryPath);
+    if (producer.path == NULL)
+        return -1;
+
+    producer.list = list;
+    producer.allowedExtensions = allowedExtensions;
+    producer.count = 0;
+    producer.done = false;
+    producer.stop = false;
+
+    if (pthread_create(&producer.thread, NULL, playlistProducerThread, &producer) != 0)
     {
-        printf("Failed to scan directory: %s\n", directoryPath);
-        return;
+        free(producer.path);
+        producer.path = NULL;
+        return -1;
     }
+    producer.running = true;
 
-    for (int i = 0; i < numEntries && playlist->count < MAX_FILES; i++)
-    {
-        struct dirent *entry = entries[i];
+    // Nothing is shown yet, so this is the one place that waits for the scan
+    pthread_mutex_lock(&producer.mutex);
+    while (producer.count == 0 && !producer.done)
+        pthread_cond_wait(&producer.cond, &producer.mutex);
+    pthread_mutex_unlock(&producer.mutex);
 
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-        {
-            continue;
-        }
+    drawPendingSongs(list);
+    return 0;
+}
 
-        char filePath[FILENAME_MAX];
-        snprintf(filePath, sizeof(filePath), "%s/%s", directoryPath, entry->d_name);
+bool isPlaylistGrowing(PlayList *list)
+{
+    bool growing;
 
-        if (isDirectory(filePath))
-        {
-            int songCount = playlist->count;
-            buildPlaylistRecursive(filePath, allowedExtensions, playlist);
-            if (playlist->count > songCount)
-                numDirs++;
-        }
-        else
+    if (!producer.running || producer.list != list)
+        return false;
+
+    pthread_mutex_lock(&producer.mutex);
+    growing = !producer.done || producer.count > 0;
+    pthread_mutex_unlock(&producer.mutex);
+
+    return growing;
+}
+
+// Moves one random song found by the scan to the playlist, or all of them once the scan is done.
+// Returns false without waiting when there is nothing to move.
+bool drawPendingSongs(PlayList *list)
+{
+    bool added = false;
+
+    if (!producer.running || producer.list != list)
+        return false;
+
+    pthread_mutex_lock(&producer.mutex);
+
+    if (producer.done)
+    {
+        for (int i = producer.count - 1; i >= 0; i--)
         {
-            extractExtension(entry->d_name, sizeof(exto) - 1, exto);
-            if (match_regex(&regex, exto) == 0)
-            {
-                SongInfo song;
-                snprintf(filePath, sizeof(filePath), "%s/%s", directoryPath, entry->d_name);
-                song.filePath = strdup(filePath);
-                song.duration = 0.0;
-                addToList(playlist, song);
-            }
+            int k = rand() % (i + 1);
+            addToList(list, producer.songs[k]);
+            producer.songs[k] = producer.songs[i];
         }
+        added = (producer.count > 0);
+        producer.count = 0;
     }
-
-    for (int i = 0; i < numEntries; i++)
+    else if (producer.count > 0)
     {
-        free(entries[i]);
+        int k = rand() % producer.count;
+        addToList(list, producer.songs[k]);
+        producer.songs[k] = producer.songs[--producer.count];
+        added = true;
     }
-    free(entries);
 
-    closedir(dir);
-    regfree(&regex);
+    pthread_mutex_unlock(&producer.mutex);
+
+    return added;
+}
+
+void stopPlaylistProducer()
+{
+    if (!producer.running)
+        return;
+
+    pthread_mutex_lock(&producer.mutex);
+    producer.stop = true;
+    pthread_mutex_unlock(&producer.mutex);
+
+    pthread_join(producer.thread, NULL);
+
+    for (int i = 0; i < producer.count; i++)
+        releaseSongInfo(&producer.songs[i]);
+    free(producer.songs);
+    free(producer.path);
+    producer.songs = NULL;
+    producer.path = NULL;
+    producer.count = 0;
+    producer.capacity = 0;
+    producer.list = NULL;
+    producer.running = false;
 }
 
 int playDirectory(const char *directoryPath, const char *allowedExtensions, PlayList *playlist)
@@ -303,10 +748,7 @@ int playDirectory(const char *directoryPath, const char *allowedExtensions, Play
         {
             char filePath[FILENAME_MAX];
             snprintf(filePath, sizeof(filePath), "%s/%s", directoryPath, entry->d_name);
-            SongInfo song;
-            song.duration = 0.0;
-            song.filePath = strdup(filePath);
-            addToList(playlist, song);
+            addPathToList(playlist, filePath, 0.0);
         }
     }
     closedir(dir);
@@ -314,6 +756,7 @@ int playDirectory(const char *directoryPath, const char *allowedExtensions, Play
     return 0;
 }
 
+// Nodes belong to the playlist that allocated them, so the songs are copied over and src is emptied
 int joinPlaylist(PlayList *dest, PlayList *src)
 {
     if (src->count == 0)
@@ -321,22 +764,13 @@ int joinPlaylist(PlayList *dest, PlayList *src)
         return 0;
     }
 
-    if (dest->count == 0)
-    {
-        dest->head = src->head;
-        dest->tail = src->tail;
-    }
-    else
+    for (Node *node = getPlayListFirst(src); node != NULL; node = getPlayListNext(src, node))
     {
-        dest->tail->next = src->head;
-        src->head->prev = dest->tail;
-        dest->tail = src->tail;
+        retainSongInfo(&node->song);
+        addToList(dest, node->song);
     }
-    dest->count += src->count;
 
-    src->head = NULL;
-    src->tail = NULL;
-    src->count = 0;
+    deletePlaylist(src);
 
     return 1;
 }
@@ -364,7 +798,7 @@ int makePlaylist(int argc, char *argv[])
     int searchTypeIndex = 1;
 
     const char *delimiter = ":";
-    PlayList partialPlaylist = {NULL, NULL, 0, 0.0};
+    PlayList partialPlaylist = {NULL, NULL, 0, 0.0, NULL, 0, 0, NULL, {false, 0, 0, 0, 0}, NULL, NULL};
 
     const char *allowedExtensions = ALLOWED_EXTENSIONS;
 
@@ -400,10 +834,12 @@ int makePlaylist(int argc, char *argv[])
             searchType = DirOnly;
         else if (strcmp(argv[searchTypeIndex], "song") == 0)
             searchType = FileOnly;
+        else if (strcmp(argv[searchTypeIndex], "query") == 0)
+            searchType = SearchTags;
     }
     int start = searchTypeIndex + 1;
 
-    if (searchType == FileOnly || searchType == DirOnly || searchType == SearchPlayList)
+    if (searchType == FileOnly || searchType == DirOnly || searchType == SearchPlayList || searchType == SearchTags)
         start = searchTypeIndex + 2;
 
     search[0] = '\0';
@@ -415,14 +851,24 @@ int makePlaylist(int argc, char *argv[])
     }
     makePlaylistName(search);
 
-    if (strstr(search, delimiter))
+    // Tag queries use ':' for fields, not for joining searches
+    if (searchType != SearchTags && strstr(search, delimiter))
     {
         shuffle = true;
     }
 
     if (searchType == ReturnAllSongs)
     {
-        buildPlaylistRecursive(settings.path, allowedExtensions, &playlist);
+        // Songs are drawn at random while the library is scanned, so the playlist is already shuffled
+        if (startPlaylistProducer(settings.path, allowedExtensions, &playlist) == 0)
+            shuffle = false;
+        else
+            buildPlaylistRecursive(settings.path, allowedExtensions, &playlist);
+    }
+    else if (searchType == SearchTags)
+    {
+        queryLibrary(settings.path, search, &playlist);
+        numDirs = 0;
     }
     else
     {
@@ -455,7 +901,7 @@ int makePlaylist(int argc, char *argv[])
     }
     if (numDirs > 1)
         shuffle = true;
-    if (shuffle)
+    if (shuffle && !isPlaylistGrowing(&playlist))
         shufflePlaylist(&playlist);
 
     if (playlist.head == NULL)
@@ -487,13 +933,13 @@ void *getDurationsThread(void *arg)
             currentNode = getListNext(currentNode);
             continue;
         }
-        if (currentNode->song.filePath == NULL)
+        if (currentNode->song.fileName == NULL)
         {
             currentNode = getListNext(currentNode);
             continue;
         }
         char musicFilepath[MAX_FILENAME_LENGTH];
-        strcpy(musicFilepath, currentNode->song.filePath);
+        getSongPath(&currentNode->song, musicFilepath, sizeof(musicFilepath));
         double duration = ((currentNode->song.duration > 0.0) ? currentNode->song.duration : getDuration(musicFilepath));
         if (duration > 0.0)
         {
@@ -517,7 +963,7 @@ void *getDurationsThread(void *arg)
 
 int calculatePlayListDuration(PlayList *playlist)
 {
-    if (playlist->count > MAX_COUNT_PLAYLIST_SONGS)
+    if (playlist->count > MAX_COUNT_PLAYLIST_SONGS || isPlaylistGrowing(playlist))
         return 0;
 
     startPlayListDurationCount();
@@ -545,117 +991,337 @@ void startPlayListDurationCount()
     stopPlaylistDurationThread = 0;
 }
 
+// #EXTINF:<seconds>,<title>
+void parseExtInf(const char *line, size_t length, double *duration, char *title, size_t titleSize)
+{
+    char number[32];
+    size_t prefixLength = strlen("#EXTINF:");
+    const char *comma = memchr(line, ',', length);
+    size_t numberLength = (comma != NULL ? (size_t)(comma - line) : length) - prefixLength;
+
+    if (numberLength >= sizeof(number))
+        numberLength = sizeof(number) - 1;
+    memcpy(number, line + prefixLength, numberLength);
+    number[numberLength] = '\0';
+    *duration = atof(number);
+
+    title[0] = '\0';
+    if (comma != NULL)
+    {
+        size_t titleLength = length - (comma + 1 - line);
+        if (titleLength >= titleSize)
+            titleLength = titleSize - 1;
+        memcpy(title, comma + 1, titleLength);
+        title[titleLength] = '\0';
+    }
+}
+
+/*
+Reads .m3u and .m3u8 files. The file is mapped and split into lines in place. Durations and
+titles from #EXTINF lines are kept with the song that follows, so those songs never need to be probed.
+*/
 void readM3UFile(const char *filename, PlayList *playlist)
 {
-    FILE *file = fopen(filename, "r");
     char directory[MAXPATHLEN];
+    char songPath[MAXPATHLEN];
+    char title[MAXPATHLEN];
+    struct stat fileStats;
+    double duration = 0.0;
+    double totalDuration = 0.0;
+    bool allDurationsKnown = true;
+    int songCount = playlist->count;
 
-    if (file == NULL)
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    if (fstat(fd, &fileStats) != 0 || fileStats.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+
+    const char *data = mmap(NULL, fileStats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
     {
         return;
     }
+    madvise((void *)data, fileStats.st_size, MADV_SEQUENTIAL);
 
     getDirectoryFromPath(filename, directory);
-    char line[MAXPATHLEN];
-    while (fgets(line, sizeof(line), file))
+    size_t directoryLength = strlen(directory);
+    title[0] = '\0';
+
+    const char *end = data + fileStats.st_size;
+    const char *p = data;
+
+    // UTF-8 byte order mark, sometimes found at the start of .m3u8 files
+    if (end - p >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+        p += 3;
+
+    while (p < end)
     {
-        size_t len = strcspn(line, "\r\n");
-        line[len] = '\0';
+        const char *newline = memchr(p, '\n', end - p);
+        const char *lineEnd = (newline != NULL) ? newline : end;
+        const char *line = p;
+        p = (newline != NULL) ? newline + 1 : end;
+
+        while (line < lineEnd && isspace((unsigned char)*line))
+            line++;
+        while (lineEnd > line && isspace((unsigned char)lineEnd[-1]))
+            lineEnd--;
+
+        size_t length = lineEnd - line;
+        if (length == 0)
+            continue;
 
-        size_t start = 0;
-        while (isspace(line[start]))
-        {
-            start++;
-        }
-        size_t end = strlen(line);
-        while (end > start && isspace(line[end - 1]))
+        if (line[0] == '#')
         {
-            end--;
+            if (length > strlen("#EXTINF:") && strncmp(line, "#EXTINF:", strlen("#EXTINF:")) == 0)
+                parseExtInf(line, length, &duration, title, sizeof(title));
+            continue;
         }
-        line[end] = '\0';
 
-        if (line[0] != '#' && line[0] != '\0')
+        // Names without a separator are relative to the playlist
+        size_t prefixLength = 0;
+        if (memchr(line, '/', length) == NULL && memchr(line, '\\', length) == NULL)
+            prefixLength = directoryLength;
+
+        if (prefixLength + length < sizeof(songPath))
         {
-            char songPath[MAXPATHLEN];
-            memset(songPath, '\0', sizeof(songPath));
+            memcpy(songPath, directory, prefixLength);
+            memcpy(songPath + prefixLength, line, length);
+            songPath[prefixLength + length] = '\0';
+
+            SongInfo song = makeSongInfo(songPath, duration > 0.0 ? duration : 0.0);
+            if (title[0] != '\0')
+                song.title = poolStrdup(title);
+            if (song.fileName != NULL)
+                addToList(playlist, song);
+            else
+                releaseSongInfo(&song);
 
-            if (strchr(line, '/') == NULL && strchr(line, '\\') == NULL)
-                strcat(songPath, directory);
+            if (duration > 0.0)
+                totalDuration += duration;
+            else
+                allDurationsKnown = false;
+        }
 
-            strcat(songPath, line);
+        duration = 0.0;
+        title[0] = '\0';
+    }
 
-            Node *newNode = (Node *)malloc(sizeof(Node));
-            newNode->song.filePath = strdup(songPath);
-            newNode->song.duration = 0.0;
-            newNode->next = NULL;
-            newNode->prev = NULL;
+    munmap((void *)data, fileStats.st_size);
 
-            if (playlist->head == NULL)
-            {
-                playlist->head = newNode;
-                playlist->tail = newNode;
-            }
-            else
-            {
-                playlist->tail->next = newNode;
-                newNode->prev = playlist->tail;
-                playlist->tail = newNode;
-            }
+    if (allDurationsKnown && songCount == 0 && playlist->count > 0)
+        playlist->totalDuration = totalDuration;
+}
 
-            playlist->count++;
-        }
+void writeM3UEntry(FILE *file, const char *directory, Node *node)
+{
+    if (node->song.duration > 0.0 || node->song.title != NULL)
+    {
+        int seconds = (node->song.duration > 0.0) ? (int)(node->song.duration + 0.5) : -1;
+        fprintf(file, "#EXTINF:%d,", seconds);
+        if (node->song.title != NULL)
+            fputs(node->song.title, file);
+        fputc('\n', file);
     }
-    fclose(file);
+
+    if (directory != NULL)
+    {
+        fputs(directory, file);
+        fputc('/', file);
+    }
+    fputs(node->song.fileName, file);
+    fputc('\n', file);
 }
 
+// Written to a temporary file that replaces the playlist once complete, so a crash never leaves it truncated
 void writeM3UFile(const char *filename, PlayList *playlist)
 {
-    FILE *file = fopen(filename, "w");
+    char tempPath[MAXPATHLEN];
+    char buffer[65536];
+
+    if (snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", filename) >= (int)sizeof(tempPath))
+    {
+        return;
+    }
+
+    int fd = mkstemp(tempPath);
+    if (fd < 0)
+    {
+        return;
+    }
+    fchmod(fd, 0644);
+
+    FILE *file = fdopen(fd, "w");
     if (file == NULL)
     {
+        close(fd);
+        unlink(tempPath);
         return;
     }
+    setvbuf(file, buffer, _IOFBF, sizeof(buffer));
 
-    Node *currentNode = playlist->head;
+    fputs("#EXTM3U\n", file);
+
+    // Consecutive songs are usually in the same directory, so it is only looked up when it changes
+    const char *directory = NULL;
+    int dirId = -1;
+    Node *currentNode = getPlayListFirst(playlist);
     while (currentNode != NULL)
     {
-        fprintf(file, "%s\n", currentNode->song.filePath);
-        currentNode = currentNode->next;
+        if (currentNode->song.dirId != dirId || directory == NULL)
+        {
+            dirId = currentNode->song.dirId;
+            directory = getInternedDirectory(dirId);
+        }
+        writeM3UEntry(file, directory, currentNode);
+        currentNode = getPlayListNext(playlist, currentNode);
+    }
+
+    bool failed = (fflush(file) != 0 || ferror(file) || fsync(fd) != 0);
+    if (fclose(file) != 0 || failed || rename(tempPath, filename) != 0)
+    {
+        unlink(tempPath);
+    }
+}
+
+/*
+The main playlist is kept as cue.m3u plus a log of the songs added and removed since it was
+last written, so a change only appends a line. The log is replayed on load and folded back
+into cue.m3u once it has grown to about half the size of the playlist.
+*/
+void makeMainPlaylistPath(const char *directory, const char *name, char *path, size_t size)
+{
+    size_t length = strlen(directory);
+    snprintf(path, size, "%s%s%s", directory, (length > 0 && directory[length - 1] == '/') ? "" : "/", name);
+}
+
+void replayMainPlaylistLog()
+{
+    FILE *file = fopen(mainPlaylistLogPath, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+
+    if (file == NULL)
+        return;
+
+    while ((length = getline(&line, &capacity, file)) > 0)
+    {
+        if (line[length - 1] == '\n')
+            line[--length] = '\0';
+        if (length < 2 || (line[0] != '+' && line[0] != '-'))
+            continue;
+
+        SongInfo song = makeSongInfo(line + 1, 0.0);
+        Node *node = findInPathIndex(mainPlaylist->index, &song);
+
+        if (line[0] == '+' && node == NULL && song.fileName != NULL)
+        {
+            addToList(mainPlaylist, song);
+        }
+        else
+        {
+            if (line[0] == '-' && node != NULL)
+                deleteFromList(mainPlaylist, node);
+            releaseSongInfo(&song);
+        }
+
+        numMainPlaylistChanges++;
     }
+
+    free(line);
     fclose(file);
 }
 
+void logMainPlaylistChange(char change, const SongInfo *song)
+{
+    char path[MAXPATHLEN];
+    FILE *file = fopen(mainPlaylistLogPath, "a");
+
+    if (file == NULL)
+        return;
+
+    fprintf(file, "%c%s\n", change, getSongPath(song, path, sizeof(path)));
+    fclose(file);
+    numMainPlaylistChanges++;
+}
+
+// Older versions could add a song more than once, the index only finds the first copy
+void removeDuplicateSongs(PlayList *list)
+{
+    if (list->index == NULL)
+        return;
+
+    Node *node = list->head;
+    while (node != NULL)
+    {
+        Node *next = node->next;
+        if (findInPathIndex(list->index, &node->song) != node)
+        {
+            deleteFromList(list, node);
+            numMainPlaylistChanges++;
+        }
+        node = next;
+    }
+}
+
 void loadMainPlaylist(const char *directory)
 {
-    char playlistPath[MAXPATHLEN];
-    strcpy(playlistPath, directory);
-    if (playlistPath[strlen(playlistPath) - 1] != '/')
-        strcat(playlistPath, "/");
-    strcat(playlistPath, mainPlaylistName);
-    mainPlaylist = malloc(sizeof(PlayList));
+    makeMainPlaylistPath(directory, mainPlaylistName, mainPlaylistPath, sizeof(mainPlaylistPath));
+    makeMainPlaylistPath(directory, mainPlaylistLogName, mainPlaylistLogPath, sizeof(mainPlaylistLogPath));
+    mainPlaylist = calloc(1, sizeof(PlayList));
     if (mainPlaylist == NULL)
     {
         printf("Failed to allocate memory for mainPlaylist.\n");
         exit(0);
     }
-    mainPlaylist->count = 0;
-    mainPlaylist->totalDuration = 0;
-    mainPlaylist->head = NULL;
-    mainPlaylist->tail = NULL;
-    readM3UFile(playlistPath, mainPlaylist);
+    readM3UFile(mainPlaylistPath, mainPlaylist);
+    mainPlaylist->index = createPathIndex(mainPlaylist);
+    removeDuplicateSongs(mainPlaylist);
+    replayMainPlaylistLog();
 }
 
-void saveMainPlaylist(const char *directory, bool isPlayingMain)
+// Returns false if the song is already in the main playlist
+bool addToMainPlaylist(SongInfo song)
 {
-    char playlistPath[MAXPATHLEN];
-    strcpy(playlistPath, directory);
-    if (playlistPath[strlen(playlistPath) - 1] != '/')
-        strcat(playlistPath, "/");
-    strcat(playlistPath, mainPlaylistName);
-    if (isPlayingMain)
-        writeM3UFile(playlistPath, &playlist);
-    else
-        writeM3UFile(playlistPath, mainPlaylist);
+    if (mainPlaylist == NULL || findInPathIndex(mainPlaylist->index, &song) != NULL)
+        return false;
+
+    retainSongInfo(&song);
+    addToList(mainPlaylist, song);
+    logMainPlaylistChange('+', &song);
+    return true;
+}
+
+bool removeFromMainPlaylist(SongInfo song)
+{
+    Node *node = (mainPlaylist != NULL) ? findInPathIndex(mainPlaylist->index, &song) : NULL;
+
+    if (node == NULL)
+        return false;
+
+    // Logged first, the song's strings may be released with the node
+    logMainPlaylistChange('-', &song);
+    deleteFromList(mainPlaylist, node);
+    return true;
+}
+
+void saveMainPlaylist()
+{
+    if (mainPlaylist == NULL || numMainPlaylistChanges < MIN_MAIN_PLAYLIST_CHANGES_TO_COMPACT || numMainPlaylistChanges * 2 < mainPlaylist->count)
+        return;
+
+    // Replaying the log again on top of the new cue.m3u changes nothing, so it doesn't matter if removing it fails
+    writeM3UFile(mainPlaylistPath, mainPlaylist);
+    unlink(mainPlaylistLogPath);
+    numMainPlaylistChanges = 0;
 }
 
 void savePlaylist()
@@ -668,41 +1334,29 @@ void savePlaylist()
     writeM3UFile(playlistPath, &playlist);
 }
 
-Node* deepCopyNode(Node* originalNode) {
-    if (originalNode == NULL) {
-        return NULL;
-    }
-
-    Node* newNode = malloc(sizeof(Node));
-    if (newNode == NULL) {
-        return NULL;
-    }
-
-    newNode->song.filePath = strdup(originalNode->song.filePath);
-    newNode->song.duration = originalNode->song.duration;
-    newNode->prev = NULL;
-    newNode->next = deepCopyNode(originalNode->next);
-
-    if (newNode->next != NULL) {
-        newNode->next->prev = newNode;
-    }
-
-    return newNode;
-}
-
+/*
+The copy shares the original's nodes until one of the two adds or deletes a song, and only the
+one making the change gets its own nodes then. Node pointers held for the one that doesn't change,
+like currentSong, stay valid. Shuffling doesn't change nodes, so it doesn't end the sharing.
+*/
 PlayList deepCopyPlayList(PlayList *originalList)
 {
-    if (originalList == NULL)
-    {
-        PlayList newList = {NULL, NULL, 0, 0.0};
+    PlayList newList = {NULL, NULL, 0, 0.0, NULL, 0, 0, NULL, {false, 0, 0, 0, 0}, NULL, NULL};
+
+    if (originalList == NULL || originalList->numNodes == 0)
         return newList;
+
+    if (originalList->shareCount == NULL)
+    {
+        originalList->shareCount = malloc(sizeof(int));
+        if (originalList->shareCount == NULL)
+            return newList;
+        *originalList->shareCount = 1;
     }
+    (*originalList->shareCount)++;
 
-    PlayList newList;
-    newList.head = deepCopyNode(originalList->head);
-    newList.tail = deepCopyNode(originalList->tail);
-    newList.count = originalList->count;
-    newList.totalDuration = originalList->totalDuration;
+    newList = *originalList;
+    newList.index = NULL;
 
     return newList;
-}
\ No newline at end of file
+}
@@ -2,17 +2,23 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <dirent.h>
 #include "soundgapless.h"
 
 #ifndef PLAYLIST_STRUCT
 #define PLAYLIST_STRUCT
 
 #define MAX_COUNT_PLAYLIST_SONGS 100
+#define PLAYLIST_CHUNK_BITS 12
+#define PLAYLIST_CHUNK_SIZE (1 << PLAYLIST_CHUNK_BITS)
 
+// Paths are split into an interned directory and a pooled file name, use getSongPath() to join them
 typedef struct
 {
-    char *filePath;
+    int dirId;
+    char *fileName;
     double duration;
+    char *title; // From the library or a playlist's #EXTINF, NULL if unknown
 } SongInfo;
 
 typedef struct Node
@@ -20,20 +26,42 @@ typedef struct Node
     SongInfo song;
     struct Node *next;
     struct Node *prev;
+    int index;
 } Node;
 
+struct PathIndex;
+
+// Play order of a shuffled playlist, computed from the seed instead of relinking the nodes
+typedef struct
+{
+    bool enabled;
+    unsigned int seed;
+    int size;
+    int offset;
+    int halfBits;
+} ShuffleOrder;
+
 typedef struct
 {
     Node *head;
     Node *tail;
     int count;
     volatile double totalDuration;
+    Node **chunks;
+    int numChunks;
+    int numNodes;
+    int *shareCount; // Set while the chunks are shared with copies, see deepCopyPlayList()
+    ShuffleOrder shuffle;
+    struct PathIndex *index; // Only kept for the main playlist
+    Node *freeNodes;         // Slots of deleted songs, linked through next and reused by the next songs added
 } PlayList;
 
 extern Node *currentSong;
 
 #endif
 
+extern const char ALLOWED_EXTENSIONS[];
+
 extern PlayList playlist;
 
 extern PlayList *mainPlaylist;
@@ -42,8 +70,20 @@ Node *getListNext(Node *node);
 
 Node *getListPrev(Node *node);
 
+Node *getListNodeAt(PlayList *list, int index);
+
+SongInfo makeSongInfo(const char *filePath, double duration);
+
+char *getSongPath(const SongInfo *song, char *buffer, size_t size);
+
+void retainSongInfo(SongInfo *song);
+
+void releaseSongInfo(SongInfo *song);
+
 void addToList(PlayList *list, SongInfo song);
 
+void addPathToList(PlayList *list, const char *filePath, double duration);
+
 Node *deleteFromList(PlayList *list, Node *node);
 
 void deletePlaylist(PlayList *playlist);
@@ -54,12 +94,32 @@ void buildPlaylistRecursive(char *directoryPath, const char *allowedExtensions,
 
 int playDirectory(const char *directoryPath, const char *allowedExtensions, PlayList *playlist);
 
+Node *getPlayListFirst(PlayList *list);
+
+Node *getPlayListNext(PlayList *list, Node *node);
+
+Node *getPlayListPrev(PlayList *list, Node *node);
+
+Node *drawPlayListNext(PlayList *list, Node *node);
+
+bool isPlayListNextPending(PlayList *list, Node *node);
+
+void shufflePlaylistWithSeed(PlayList *playlist, Node *song, unsigned int seed);
+
 void shufflePlaylist(PlayList *playlist);
 
 void shufflePlaylistStartingFromSong(PlayList *playlist, Node *song);
 
 int joinPlaylist(PlayList *dest, PlayList *src);
 
+int startPlaylistProducer(const char *directoryPath, const char *allowedExtensions, PlayList *list);
+
+bool isPlaylistGrowing(PlayList *list);
+
+bool drawPendingSongs(PlayList *list);
+
+void stopPlaylistProducer();
+
 int makePlaylist(int argc, char *argv[]);
 
 int calculatePlayListDuration(PlayList *playlist);
@@ -74,10 +134,12 @@ void writeM3UFile(const char *filename, PlayList *playlist);
 
 void loadMainPlaylist(const char *directory);
 
-void saveMainPlaylist(const char *directory, bool isPlayingMain);
+bool addToMainPlaylist(SongInfo song);
 
-void savePlaylist();
+bool removeFromMainPlaylist(SongInfo song);
+
+void saveMainPlaylist();
 
-Node *deepCopyNode(Node *originalNode);
+void savePlaylist();
 
 PlayList deepCopyPlayList(PlayList *originalList);
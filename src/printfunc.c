@@ -18,7 +18,7 @@ void printHelp()
     printf("\n");
     printf("Usage:    cue path \"path to music library\"\n");
     printf("          (Saves the music library path. Use this the first time. Ie: cue path \"/home/joe/Music/\")\n");
-    printf("          cue (no argument, loads all your songs up to 10 000)\n");
+    printf("          cue (no argument, loads all your songs)\n");
     printf("          cue <song name,directory or playlist words>\n");
     printf("          cue --help, -? or -h\n");
     printf("          cue --version or -v\n");
@@ -26,6 +26,7 @@ void printHelp()
     printf("          cue song <song name> \n");
     printf("          cue list <m3u list name> \n");
     printf("          cue shuffle <dir name> (random and rand works too)\n");
+    printf("          cue query <tag query> (ie: cue query artist:radiohead year:1995..2001 -live)\n");
     printf("          cue artistA:artistB (plays artistA and artistB shuffled)");
     printf("\n");
     printf("Examples: cue moon (Plays the first song or directory it finds that has the word moon, ie moonlight sonata)\n");
@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <float.h>
+#include "query.h"
+#include "stringpool.h"
+
+/*
+Query syntax, all terms must match:
+
+    radiohead               any of title, artist, album artist, album or file name
+    artist:radiohead        a single field (title, artist, albumartist, album, format)
+    album:ok*               trailing * matches words by prefix
+    year:1995..2001         ranges, either end can be left out (year:..1990)
+    duration:3:00..5:00     seconds or m:ss
+    -live                   a leading - excludes the matches
+*/
+
+typedef struct
+{
+    const char *name;
+    QueryField field;
+} FieldName;
+
+static const FieldName fieldNames[] = {
+    {"title", QUERY_TITLE},
+    {"artist", QUERY_ARTIST},
+    {"albumartist", QUERY_ALBUMARTIST},
+    {"album_artist", QUERY_ALBUMARTIST},
+    {"album", QUERY_ALBUM},
+    {"format", QUERY_FORMAT},
+    {"ext", QUERY_FORMAT},
+    {"year", QUERY_YEAR},
+    {"date", QUERY_YEAR},
+    {"duration", QUERY_DURATION},
+    {"length", QUERY_DURATION}};
+
+const char *getFieldKeys(QueryField field)
+{
+    switch (field)
+    {
+    case QUERY_TITLE:
+        return "t";
+    case QUERY_ARTIST:
+        return "a";
+    case QUERY_ALBUMARTIST:
+        return "b";
+    case QUERY_ALBUM:
+        return "l";
+    case QUERY_FORMAT:
+        return "f";
+    default:
+        return "tabln";
+    }
+}
+
+// The whole string has to be the number: a year, seconds or m:ss for a duration
+bool parseNumber(const char *str, QueryField field, double *number)
+{
+    int minutes = 0;
+    int seconds = 0;
+    int consumed = 0;
+    char *end;
+
+    if (!isdigit((unsigned char)str[0]))
+        return false;
+
+    if (field == QUERY_DURATION && strchr(str, ':') != NULL)
+    {
+        if (sscanf(str, "%d:%d%n", &minutes, &seconds, &consumed) != 2 || str[consumed] != '\0' ||
+            !isdigit((unsigned char)str[strcspn(str, ":") + 1]) || seconds >= 60)
+            return false;
+        *number = minutes * 60.0 + seconds;
+        return true;
+    }
+
+    if (field == QUERY_YEAR)
+        *number = (double)strtol(str, &end, 10);
+    else
+        *number = strtod(str, &end);
+    return *end == '\0';
+}
+
+bool parseRange(const char *value, QueryField field, double *min, double *max)
+{
+    const char *dots = strstr(value, "..");
+    char low[32];
+
+    *min = -DBL_MAX;
+    *max = DBL_MAX;
+
+    if (dots == NULL)
+    {
+        if (!parseNumber(value, field, min))
+            return false;
+        // An exact duration means the whole second, an exact year just that year
+        *max = (field == QUERY_DURATION) ? *min + 1.0 : *min;
+        return true;
+    }
+
+    // At least one end has to be given
+    if (dots == value && dots[2] == '\0')
+        return false;
+
+    if (dots != value)
+    {
+        if ((size_t)(dots - value) >= sizeof(low))
+            return false;
+        memcpy(low, value, dots - value);
+        low[dots - value] = '\0';
+        if (!parseNumber(low, field, min))
+            return false;
+    }
+    if (dots[2] != '\0' && !parseNumber(dots + 2, field, max))
+        return false;
+    return true;
+}
+
+bool parseTerm(const char *text, QueryTerm *term)
+{
+    memset(term, 0, sizeof(QueryTerm));
+    term->field = QUERY_ANY;
+
+    if (text[0] == '-' && text[1] != '\0')
+    {
+        term->negate = true;
+        text++;
+    }
+
+    const char *value = text;
+    const char *colon = strchr(text, ':');
+    if (colon != NULL)
+    {
+        for (size_t i = 0; i < sizeof(fieldNames) / sizeof(fieldNames[0]); i++)
+        {
+            if (strlen(fieldNames[i].name) == (size_t)(colon - text) && strncasecmp(text, fieldNames[i].name, colon - text) == 0)
+            {
+                term->field = fieldNames[i].field;
+                value = colon + 1;
+                break;
+            }
+        }
+    }
+
+    if (term->field == QUERY_YEAR || term->field == QUERY_DURATION)
+        return parseRange(value, term->field, &term->min, &term->max);
+
+    size_t length = strlen(value);
+    term->prefix = (length > 0 && value[length - 1] == '*');
+    term->numWords = tokenizeText(value, term->words, MAX_QUERY_WORDS);
+    return true;
+}
+
+// Returns -1 when a term is invalid
+int parseQuery(const char *query, QueryTerm *terms, int maxTerms)
+{
+    char text[512];
+    int numTerms = 0;
+    const char *p = query;
+
+    while (*p != '\0' && numTerms < maxTerms)
+    {
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0')
+            break;
+
+        // Double quotes keep several words in one term: artist:"the cure"
+        size_t length = 0;
+        bool quoted = false;
+        while (*p != '\0' && (quoted || !isspace((unsigned char)*p)))
+        {
+            if (*p == '"')
+                quoted = !quoted;
+            else if (length < sizeof(text) - 1)
+                text[length++] = *p;
+            p++;
+        }
+        text[length] = '\0';
+
+        // A term that can't be understood would otherwise make the query match more than was asked for
+        if (!parseTerm(text, &terms[numTerms]))
+        {
+            printf("Invalid search term: %s\n", text);
+            return -1;
+        }
+        // Words like "&" aren't indexed, so they don't narrow the search either
+        if (terms[numTerms].field == QUERY_YEAR || terms[numTerms].field == QUERY_DURATION || terms[numTerms].numWords > 0)
+            numTerms++;
+    }
+    return numTerms;
+}
+
+int compareInts(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Merges posting lists into one sorted list without duplicates
+void unionPostings(PostingList **lists, int numLists, DocList *result)
+{
+    int total = 0;
+    for (int i = 0; i < numLists; i++)
+        total += lists[i]->count;
+
+    result->docs = malloc((total > 0 ? total : 1) * sizeof(int));
+    result->count = 0;
+    if (result->docs == NULL)
+        return;
+
+    for (int i = 0; i < numLists; i++)
+    {
+        memcpy(result->docs + result->count, lists[i]->docs, lists[i]->count * sizeof(int));
+        result->count += lists[i]->count;
+    }
+
+    if (numLists > 1)
+    {
+        qsort(result->docs, result->count, sizeof(int), compareInts);
+        int unique = 0;
+        for (int i = 0; i < result->count; i++)
+        {
+            if (unique == 0 || result->docs[unique - 1] != result->docs[i])
+                result->docs[unique++] = result->docs[i];
+        }
+        result->count = unique;
+    }
+}
+
+// Keeps the documents in a that are also in b, both are sorted
+void intersectDocs(DocList *a, DocList *b)
+{
+    int i = 0, j = 0, count = 0;
+    while (i < a->count && j < b->count)
+    {
+        if (a->docs[i] < b->docs[j])
+            i++;
+        else if (a->docs[i] > b->docs[j])
+            j++;
+        else
+        {
+            a->docs[count++] = a->docs[i];
+            i++;
+            j++;
+        }
+    }
+    a->count = count;
+}
+
+bool containsDoc(DocList *list, int doc)
+{
+    return bsearch(&doc, list->docs, list->count, sizeof(int), compareInts) != NULL;
+}
+
+int collectPostings(LibraryIndex *index, const char *low, const char *high, PostingList ***lists, int *numLists, int *capacity)
+{
+    int first, last;
+    findPostingRange(index, low, high, &first, &last);
+    for (int i = first; i < last; i++)
+    {
+        if (*numLists == *capacity)
+        {
+            int newCapacity = *capacity > 0 ? *capacity * 2 : 16;
+            PostingList **newLists = realloc(*lists, newCapacity * sizeof(PostingList *));
+            if (newLists == NULL)
+                return -1;
+            *lists = newLists;
+            *capacity = newCapacity;
+        }
+        (*lists)[(*numLists)++] = &index->postings[i];
+    }
+    return 0;
+}
+
+void evaluateWord(LibraryIndex *index, const char *fields, const char *word, bool prefix, DocList *result)
+{
+    PostingList **lists = NULL;
+    int numLists = 0;
+    int capacity = 0;
+    char low[LIBRARY_TOKEN_LENGTH + 2];
+    char high[LIBRARY_TOKEN_LENGTH + 3];
+
+    for (const char *field = fields; *field != '\0'; field++)
+    {
+        snprintf(low, sizeof(low), "%c:%s", *field, word);
+        snprintf(high, sizeof(high), "%s%s", low, prefix ? "\xff" : "");
+        collectPostings(index, low, high, &lists, &numLists, &capacity);
+    }
+    unionPostings(lists, numLists, result);
+    free(lists);
+}
+
+void evaluateTerm(LibraryIndex *index, QueryTerm *term, DocList *result)
+{
+    if (term->field == QUERY_YEAR)
+    {
+        PostingList **lists = NULL;
+        int numLists = 0;
+        int capacity = 0;
+        char low[16];
+        char high[16];
+        int minYear = term->min < 0 ? 0 : (int)term->min;
+        int maxYear = term->max > 9999 ? 9999 : (int)term->max;
+
+        snprintf(low, sizeof(low), "y:%04d", minYear);
+        snprintf(high, sizeof(high), "y:%04d", maxYear);
+        collectPostings(index, low, high, &lists, &numLists, &capacity);
+        unionPostings(lists, numLists, result);
+        free(lists);
+        return;
+    }
+
+    const char *fields = getFieldKeys(term->field);
+    evaluateWord(index, fields, term->words[0], term->prefix && term->numWords == 1, result);
+
+    for (int i = 1; i < term->numWords && result->count > 0; i++)
+    {
+        DocList words;
+        evaluateWord(index, fields, term->words[i], term->prefix && i == term->numWords - 1, &words);
+        intersectDocs(result, &words);
+        free(words.docs);
+    }
+}
+
+int compareDocListSize(const void *a, const void *b)
+{
+    return ((const DocList *)a)->count - ((const DocList *)b)->count;
+}
+
+int evaluateQuery(LibraryIndex *index, QueryTerm *terms, int numTerms, DocList *result)
+{
+    DocList positive[MAX_QUERY_TERMS];
+    DocList negative[MAX_QUERY_TERMS];
+    int numPositive = 0;
+    int numNegative = 0;
+
+    result->docs = NULL;
+    result->count = 0;
+
+    for (int i = 0; i < numTerms; i++)
+    {
+        if (terms[i].field == QUERY_DURATION)
+            continue;
+        if (terms[i].negate)
+            evaluateTerm(index, &terms[i], &negative[numNegative++]);
+        else
+            evaluateTerm(index, &terms[i], &positive[numPositive++]);
+    }
+
+    if (numPositive > 0)
+    {
+        // Intersect starting from the rarest term so the candidate set shrinks fast
+        qsort(positive, numPositive, sizeof(DocList), compareDocListSize);
+        *result = positive[0];
+        for (int i = 1; i < numPositive; i++)
+        {
+            intersectDocs(result, &positive[i]);
+            free(positive[i].docs);
+        }
+    }
+    else
+    {
+        result->docs = malloc((index->count > 0 ? index->count : 1) * sizeof(int));
+        if (result->docs != NULL)
+        {
+            for (int i = 0; i < index->count; i++)
+                result->docs[i] = i;
+            result->count = index->count;
+        }
+    }
+
+    int count = 0;
+    for (int i = 0; i < result->count; i++)
+    {
+        int doc = result->docs[i];
+        bool keep = true;
+
+        for (int j = 0; j < numNegative && keep; j++)
+        {
+            if (containsDoc(&negative[j], doc))
+                keep = false;
+        }
+
+        for (int j = 0; j < numTerms && keep; j++)
+        {
+            if (terms[j].field != QUERY_DURATION)
+                continue;
+            double duration = index->entries[doc].duration;
+            bool inRange = duration >= terms[j].min && duration <= terms[j].max;
+            keep = (inRange != terms[j].negate);
+        }
+
+        if (keep)
+            result->docs[count++] = doc;
+    }
+    result->count = count;
+
+    for (int i = 0; i < numNegative; i++)
+        free(negative[i].docs);
+
+    return result->count;
+}
+
+int queryLibrary(const char *musicPath, const char *query, PlayList *playlist)
+{
+    QueryTerm terms[MAX_QUERY_TERMS];
+    LibraryIndex index;
+    DocList result;
+
+    int numTerms = parseQuery(query, terms, MAX_QUERY_TERMS);
+    if (numTerms <= 0)
+        return 0;
+
+    if (loadLibraryIndex(&index, musicPath) < 0)
+        return 0;
+
+    evaluateQuery(&index, terms, numTerms, &result);
+
+    for (int i = 0; i < result.count; i++)
+    {
+        LibraryEntry *entry = &index.entries[result.docs[i]];
+        SongInfo song = makeSongInfo(entry->filePath, entry->duration);
+        if (entry->title != NULL && entry->title[0] != '\0')
+            song.title = poolStrdup(entry->title);
+        if (song.fileName != NULL)
+            addToList(playlist, song);
+        else
+            releaseSongInfo(&song);
+    }
+
+    int count = result.count;
+    free(result.docs);
+    freeLibraryIndex(&index);
+
+    return count;
+}
@@ -0,0 +1,45 @@
+#ifndef QUERY_H
+#define QUERY_H
+#include <stdbool.h>
+#include "library.h"
+#include "playlist.h"
+
+#define MAX_QUERY_TERMS 32
+#define MAX_QUERY_WORDS 8
+
+typedef enum
+{
+    QUERY_ANY,
+    QUERY_TITLE,
+    QUERY_ARTIST,
+    QUERY_ALBUMARTIST,
+    QUERY_ALBUM,
+    QUERY_FORMAT,
+    QUERY_YEAR,
+    QUERY_DURATION
+} QueryField;
+
+typedef struct
+{
+    QueryField field;
+    bool negate;
+    bool prefix;
+    double min;
+    double max;
+    int numWords;
+    char words[MAX_QUERY_WORDS][LIBRARY_TOKEN_LENGTH];
+} QueryTerm;
+
+typedef struct
+{
+    int *docs;
+    int count;
+} DocList;
+
+int parseQuery(const char *query, QueryTerm *terms, int maxTerms);
+
+int evaluateQuery(LibraryIndex *index, QueryTerm *terms, int numTerms, DocList *result);
+
+int queryLibrary(const char *musicPath, const char *query, PlayList *playlist);
+
+#endif
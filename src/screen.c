@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "screen.h"
+
+/*
+A screen model for the rows that change on every tick. Drawing only changes the back buffer, a flush compares
+it with the front buffer and writes the cells that differ, with relative cursor moves and colour changes only
+where the colour changes, into stdout's buffer, so they go out with the rest of the frame. The cursor is back on
+row 0 afterwards.
+*/
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t size;
+    bool failed;
+} ScreenOutput;
+
+static const ScreenCell blankCell = {" ", {0, 0, 0}, true};
+
+int screenResize(ScreenRegion *screen, int width, int height)
+{
+    if (width == screen->width && height == screen->height && screen->front != NULL)
+        return 0;
+
+    if (width <= 0 || height <= 0)
+        return -1;
+
+    ScreenCell *front = malloc(sizeof(ScreenCell) * width * height);
+    ScreenCell *back = malloc(sizeof(ScreenCell) * width * height);
+    if (front == NULL || back == NULL)
+    {
+        free(front);
+        free(back);
+        return -1;
+    }
+
+    free(screen->front);
+    free(screen->back);
+    screen->front = front;
+    screen->back = back;
+    screen->width = width;
+    screen->height = height;
+
+    for (int i = 0; i < width * height; i++)
+        screen->back[i] = blankCell;
+    screen->valid = false;
+    return 0;
+}
+
+void screenInvalidate(ScreenRegion *screen)
+{
+    screen->valid = false;
+}
+
+void screenClearRow(ScreenRegion *screen, int row)
+{
+    if (row < 0 || row >= screen->height)
+        return;
+
+    for (int col = 0; col < screen->width; col++)
+        screen->back[row * screen->width + col] = blankCell;
+}
+
+void screenPut(ScreenRegion *screen, int row, int col, const char *glyph, PixelData color, bool defaultColor)
+{
+    if (row < 0 || row >= screen->height || col < 0 || col >= screen->width)
+        return;
+
+    ScreenCell *cell = &screen->back[row * screen->width + col];
+    snprintf(cell->glyph, sizeof(cell->glyph), "%s", glyph);
+    cell->color = defaultColor ? blankCell.color : color;
+    cell->defaultColor = defaultColor;
+}
+
+// Puts a column per character, returns the number of columns
+int screenPrint(ScreenRegion *screen, int row, int col, const char *text, PixelData color, bool defaultColor)
+{
+    char glyph[SCREEN_GLYPH_SIZE + 1];
+    int columns = 0;
+
+    while (*text != '\0')
+    {
+        // The length of the UTF-8 sequence comes from its first byte
+        unsigned char first = (unsigned char)*text;
+        int length = (first < 0x80) ? 1 : (first >= 0xf0) ? 4 : (first >= 0xe0) ? 3 : (first >= 0xc0) ? 2 : 1;
+
+        int i = 0;
+        for (; i < length && text[i] != '\0'; i++)
+            glyph[i] = text[i];
+        glyph[i] = '\0';
+        text += i;
+
+        screenPut(screen, row, col + columns, glyph, color, defaultColor);
+        columns++;
+    }
+    return columns;
+}
+
+bool sameCell(const ScreenCell *a, const ScreenCell *b)
+{
+    return a->defaultColor == b->defaultColor && strcmp(a->glyph, b->glyph) == 0 &&
+           (a->defaultColor || (a->color.r == b->color.r && a->color.g == b->color.g && a->color.b == b->color.b));
+}
+
+void appendOutput(ScreenOutput *output, const char *data, size_t length)
+{
+    if (output->length + length > output->size)
+    {
+        size_t size = output->size > 0 ? output->size : 4096;
+        while (output->length + length > size)
+            size *= 2;
+
+        char *grown = realloc(output->data, size);
+        if (grown == NULL)
+        {
+            output->failed = true;
+            return;
+        }
+        output->data = grown;
+        output->size = size;
+    }
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+void appendFormatted(ScreenOutput *output, const char *format, int a, int b, int c)
+{
+    char sequence[32];
+    int length = snprintf(sequence, sizeof(sequence), format, a, b, c);
+    if (length > 0)
+        appendOutput(output, sequence, length);
+}
+
+void screenFlush(ScreenRegion *screen)
+{
+    ScreenOutput output = {screen->output, 0, screen->outputSize, false};
+    const ScreenCell *current = NULL; // The colour the terminal draws with, unknown at first
+    int cursorRow = 0;
+    int cursorCol = -1; // Unknown, the cursor may rest anywhere on row 0
+
+    if (screen->front == NULL)
+        return;
+
+    for (int row = 0; row < screen->height; row++)
+    {
+        for (int col = 0; col < screen->width; col++)
+        {
+            const ScreenCell *cell = &screen->back[row * screen->width + col];
+
+            if (screen->valid && sameCell(cell, &screen->front[row * screen->width + col]))
+                continue;
+
+            if (row > cursorRow)
+            {
+                appendFormatted(&output, "\033[%dB", row - cursorRow, 0, 0);
+                cursorRow = row;
+            }
+            if (col != cursorCol)
+            {
+                if (col == 0)
+                    appendOutput(&output, "\r", 1);
+                else if (cursorCol >= 0 && col > cursorCol)
+                    appendFormatted(&output, "\033[%dC", col - cursorCol, 0, 0);
+                else
+                    appendFormatted(&output, "\r\033[%dC", col, 0, 0);
+                cursorCol = col;
+            }
+
+            if (current == NULL || current->defaultColor != cell->defaultColor ||
+                (!cell->defaultColor && (current->color.r != cell->color.r || current->color.g != cell->color.g || current->color.b != cell->color.b)))
+            {
+                if (cell->defaultColor)
+                    appendOutput(&output, "\033[0m", 4);
+                else
+                    appendFormatted(&output, "\033[0;38;2;%d;%d;%dm", cell->color.r, cell->color.g, cell->color.b);
+                current = cell;
+            }
+
+            appendOutput(&output, cell->glyph, strlen(cell->glyph));
+
+            // After the last column the terminal waits to wrap, where the cursor is then depends on the terminal
+            cursorCol = (col + 1 < screen->width) ? col + 1 : -1;
+        }
+    }
+
+    if (output.length > 0)
+    {
+        if (cursorRow > 0)
+            appendFormatted(&output, "\033[%dA", cursorRow, 0, 0);
+        appendOutput(&output, "\r\033[0m", 5);
+    }
+
+    screen->output = output.data;
+    screen->outputSize = output.size;
+
+    // Nothing is written rather than part of a frame, the next flush draws everything
+    if (output.failed)
+    {
+        screen->valid = false;
+        return;
+    }
+
+    fwrite(output.data, 1, output.length, stdout);
+
+    memcpy(screen->front, screen->back, sizeof(ScreenCell) * screen->width * screen->height);
+    screen->valid = true;
+}
+
+void freeScreen(ScreenRegion *screen)
+{
+    free(screen->front);
+    free(screen->back);
+    free(screen->output);
+    memset(screen, 0, sizeof(ScreenRegion));
+}
@@ -0,0 +1,42 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+#include <stdbool.h>
+#include <stddef.h>
+#include "write_ascii.h"
+
+#define SCREEN_GLYPH_SIZE 4
+
+typedef struct
+{
+    char glyph[SCREEN_GLYPH_SIZE + 1]; // One UTF-8 character, one column wide
+    PixelData color;
+    bool defaultColor; // Drawn in the terminal's own text colour, color is ignored
+} ScreenCell;
+
+// Rows below the cursor that are drawn by writing only the cells that changed. The cursor rests on row 0.
+typedef struct
+{
+    int width;
+    int height;
+    ScreenCell *front; // What the terminal shows
+    ScreenCell *back;  // What the next flush should show
+    bool valid;        // False when the terminal may show something else than front
+    char *output;
+    size_t outputSize;
+} ScreenRegion;
+
+int screenResize(ScreenRegion *screen, int width, int height);
+
+void screenInvalidate(ScreenRegion *screen);
+
+void screenClearRow(ScreenRegion *screen, int row);
+
+void screenPut(ScreenRegion *screen, int row, int col, const char *glyph, PixelData color, bool defaultColor);
+
+int screenPrint(ScreenRegion *screen, int row, int col, const char *text, PixelData color, bool defaultColor);
+
+void screenFlush(ScreenRegion *screen);
+
+void freeScreen(ScreenRegion *screen);
+
+#endif
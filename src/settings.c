@@ -14,6 +14,7 @@ AppSettings constructAppSettings(KeyValuePair *pairs, int count)
     strncpy(settings.coverEnabled, "1", sizeof(settings.coverEnabled));
     strncpy(settings.coverAnsi, "0", sizeof(settings.coverAnsi));
     strncpy(settings.visualizerEnabled, "0", sizeof(settings.visualizerEnabled));
+    strncpy(settings.visualizerMeasure, "0", sizeof(settings.visualizerMeasure));
 
     if (pairs == NULL)
     {
@@ -43,7 +44,15 @@ AppSettings constructAppSettings(KeyValuePair *pairs, int count)
         else if (strcmp(stringToLower(pair->key), "visualizerheight") == 0)
         {
             snprintf(settings.visualizerHeight, sizeof(settings.visualizerHeight), "%s", pair->value);
-        }        
+        }
+        else if (strcmp(stringToLower(pair->key), "visualizermeasure") == 0)
+        {
+            snprintf(settings.visualizerMeasure, sizeof(settings.visualizerMeasure), "%s", pair->value);
+        }
+        else if (strcmp(stringToLower(pair->key), "visualizerfps") == 0)
+        {
+            snprintf(settings.visualizerFps, sizeof(settings.visualizerFps), "%s", pair->value);
+        }
     }
 
     freeKeyValuePairs(pairs, count);
@@ -146,9 +155,13 @@ void getConfig()
     coverEnabled = (settings.coverEnabled[0] == '1');
     coverAnsi = (settings.coverAnsi[0] == '1');
     visualizerEnabled = (settings.visualizerEnabled[0] == '1');
+    visualizerMeasure = (settings.visualizerMeasure[0] == '1');
     int temp = atoi(settings.visualizerHeight);
     if (temp > 0)
         visualizerHeight = temp;
+    temp = atoi(settings.visualizerFps);
+    if (temp > 0)
+        visualizerFps = temp;
     getMusicLibraryPath(settings.path);
 }
 
@@ -180,7 +193,11 @@ void setConfig()
     if (settings.visualizerHeight[0] == '\0')
     {
         sprintf(settings.visualizerHeight, "%d", visualizerHeight);
-    }     
+    }
+    if (settings.visualizerMeasure[0] == '\0')
+        visualizerMeasure ? strcpy(settings.visualizerMeasure, "1") : strcpy(settings.visualizerMeasure, "0");
+    if (settings.visualizerFps[0] == '\0')
+        sprintf(settings.visualizerFps, "%d", visualizerFps);
 
     // Null-terminate the character arrays
     settings.path[MAXPATHLEN - 1] = '\0';
@@ -188,6 +205,8 @@ void setConfig()
     settings.coverAnsi[1] = '\0';
     settings.visualizerEnabled[1] = '\0';
     settings.visualizerHeight[5] = '\0';
+    settings.visualizerMeasure[1] = '\0';
+    settings.visualizerFps[5] = '\0';
 
     // Write the settings to the file
     fprintf(file, "path=%s\n", settings.path);
@@ -195,7 +214,9 @@ void setConfig()
     fprintf(file, "coverEnabled=%s\n", settings.coverEnabled);
     fprintf(file, "coverAnsi=%s\n", settings.coverAnsi);
     fprintf(file, "visualizerEnabled=%s\n", settings.visualizerEnabled);
-    fprintf(file, "visualizerHeight=%s\n", settings.visualizerHeight);    
+    fprintf(file, "visualizerHeight=%s\n", settings.visualizerHeight);
+    fprintf(file, "visualizerMeasure=%s\n", settings.visualizerMeasure);
+    fprintf(file, "visualizerFps=%s\n", settings.visualizerFps);
 
     fclose(file);
     free(filepath);
@@ -27,6 +27,8 @@ typedef struct
     char coverAnsi[2];
     char visualizerEnabled[2];
     char visualizerHeight[6];
+    char visualizerMeasure[2];
+    char visualizerFps[6];
 } AppSettings;
 
 extern AppSettings settings;
@@ -2,35 +2,22 @@
 
 void loadCover(SongData *songdata)
 {
-    char path[MAXPATHLEN];
+    CoverArt *cover = acquireCover(songdata->filePath);
 
-    if (strlen(songdata->filePath) == 0)
+    songdata->coverArt = cover;
+    if (cover == NULL || cover->bitmap == NULL)
         return;
 
-    generateTempFilePath(songdata->coverArtPath, "cover", ".jpg");
-    int res = extractCoverCommand(songdata->filePath, songdata->coverArtPath);
-    if (res < 0)
-    {
-        getDirectoryFromPath(songdata->filePath, path);
-        char *tmp = NULL;
-        off_t size = 0;
-        tmp = findLargestImageFileRecursive(path, tmp, &size);
-
-        if (tmp != NULL)
-            strcpy(songdata->coverArtPath, tmp);
-        else
-            return;
-    }
-    else
-    {
-        addToCache(tempCache, songdata->coverArtPath);
-    }
-    songdata->cover = getBitmap(songdata->coverArtPath);
+    strcpy(songdata->coverArtPath, cover->path);
+    songdata->cover = cover->bitmap;
 }
 
 void loadColor(SongData *songdata)
 {
-    getCoverColor(songdata->cover, &(songdata->red), &(songdata->green), &(songdata->blue));
+    if (songdata->cover == NULL)
+        return;
+
+    songdata->color = songdata->coverArt->palette.colors[0];
 }
 
 void loadMetaData(SongData *songdata)
@@ -62,9 +49,8 @@ SongData *loadSongData(char *filePath)
     strcpy(songdata->filePath, "");
     strcpy(songdata->coverArtPath, "");
     strcpy(songdata->pcmFilePath, "");
-    songdata->red = NULL;
-    songdata->green = NULL;
-    songdata->blue = NULL;
+    songdata->coverArt = NULL;
+    songdata->color = (PixelData){210, 210, 210};
     songdata->metadata = NULL;
     songdata->cover = NULL;
     songdata->duration = NULL;
@@ -90,22 +76,13 @@ void unloadSongData(SongData **songdata)
 
     SongData *data = *songdata;
 
-    if (data->cover != NULL)
-    {
-        FreeImage_Unload(data->cover);
-        data->cover = NULL;
-    }
+    releaseCover(data->coverArt);
 
-    free(data->red);
-    free(data->green);
-    free(data->blue);
     free(data->metadata);
     free(data->duration);
 
+    data->coverArt = NULL;
     data->cover = NULL;
-    data->red = NULL;
-    data->green = NULL;
-    data->blue = NULL;
     data->metadata = NULL;
     data->duration = NULL;
 
@@ -6,6 +6,7 @@
 #include "chafafunc.h"
 #include "albumart.h"
 #include "soundgapless.h"
+#include "covercache.h"
 
 #ifndef KEYVALUEPAIR_STRUCT
 #define KEYVALUEPAIR_STRUCT
@@ -40,11 +41,10 @@ typedef struct
     char filePath[MAXPATHLEN];
     char coverArtPath[MAXPATHLEN];
     char pcmFilePath[MAXPATHLEN];
-    unsigned char *red;
-    unsigned char *green;
-    unsigned char *blue;
+    CoverArt *coverArt; // Shared with the other songs of the album, see covercache.h
+    PixelData color; // Accent colour of the cover
     TagSettings *metadata;
-    FIBITMAP *cover;
+    FIBITMAP *cover; // The decoded cover both renderers draw from, owned by coverArt
     double *duration;
     char *pcmFile;
     long pcmFileSize;
@@ -18,7 +18,9 @@
 #define SAMPLE_WIDTH 3
 #define SAMPLE_FORMAT ma_format_s24
 #define FRAMES_PER_BUFFER 1024
-ma_int32 *g_audioBuffer = NULL;
+// The frames played last, kept as floats for the visualizer. recentFramesEnd counts frames and wraps.
+static float recentFrames[RECENT_FRAMES * CHANNELS];
+static ma_uint32 recentFramesEnd = 0;
 ma_device device = {0};
 ma_context context;
 ma_device_config deviceConfig;
@@ -138,6 +140,50 @@ void activateSwitch(PCMFileDataSource *pPCMDataSource)
     pPCMDataSource->switchFiles = true;
 }
 
+// Unpacks signed 24 bit samples, runs on the audio thread
+void storeRecentFrames(const void *pFrames, ma_uint32 frameCount)
+{
+    const unsigned char *data = pFrames;
+    ma_uint32 end = __atomic_load_n(&recentFramesEnd, __ATOMIC_RELAXED);
+
+    if (frameCount > RECENT_FRAMES)
+    {
+        data += (frameCount - RECENT_FRAMES) * CHANNELS * SAMPLE_WIDTH;
+        end += frameCount - RECENT_FRAMES;
+        frameCount = RECENT_FRAMES;
+    }
+
+    for (ma_uint32 i = 0; i < frameCount; i++)
+    {
+        float *frame = &recentFrames[((end + i) % RECENT_FRAMES) * CHANNELS];
+        for (int channel = 0; channel < CHANNELS; channel++, data += SAMPLE_WIDTH)
+        {
+            ma_int32 sample = (ma_int32)((ma_uint32)data[0] << 8 | (ma_uint32)data[1] << 16 | (ma_uint32)data[2] << 24) >> 8;
+            frame[channel] = (float)sample / 8388608.0f;
+        }
+    }
+
+    __atomic_store_n(&recentFramesEnd, end + frameCount, __ATOMIC_RELEASE);
+}
+
+// A frame that is written while it is copied can come out torn, which the visualizer doesn't mind
+int getRecentFrames(float *frames, int frameCount)
+{
+    ma_uint32 end = __atomic_load_n(&recentFramesEnd, __ATOMIC_ACQUIRE);
+
+    if (frameCount > RECENT_FRAMES)
+        frameCount = RECENT_FRAMES;
+
+    ma_uint32 start = end - frameCount;
+    for (int i = 0; i < frameCount; i++)
+    {
+        const float *frame = &recentFrames[((start + i) % RECENT_FRAMES) * CHANNELS];
+        for (int channel = 0; channel < CHANNELS; channel++)
+            frames[i * CHANNELS + channel] = frame[channel];
+    }
+    return frameCount;
+}
+
 void pcm_file_data_source_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
 {
     PCMFileDataSource *pPCMDataSource = (PCMFileDataSource *)pDataSource;
@@ -215,19 +261,7 @@ void pcm_file_data_source_read_pcm_frames(ma_data_source *pDataSource, void *pFr
         bytesToRead -= bytesRead;
     }
 
-    // Allocate memory for g_audioBuffer (if not already allocated)
-    if (g_audioBuffer == NULL)
-    {
-        g_audioBuffer = malloc(sizeof(ma_int32) * frameCount);
-        if (g_audioBuffer == NULL)
-        {
-            // Memory allocation failed
-            return;
-        }
-    }
-
-    // No format conversion needed, just copy the audio samples
-    memcpy(g_audioBuffer, pFramesOut, sizeof(ma_int32) * framesRead);
+    storeRecentFrames(pFramesOut, framesRead);
 
     if (pFramesRead != NULL)
         *pFramesRead = framesRead;
@@ -7,7 +7,8 @@
 #include <unistd.h>
 #include <sys/wait.h>
 
-extern ma_int32 *g_audioBuffer;
+#define RECENT_FRAMES 8192
+
 extern bool skipping;
 
 #ifndef PCMFILE_STRUCT
@@ -52,6 +53,9 @@ typedef struct
 
 extern bool repeatEnabled;
 
+// Copies the last frameCount frames that were played, as floats with the channels interleaved
+int getRecentFrames(float *frames, int frameCount);
+
 void createAudioDevice(UserData *userData);
 
 void resumePlayback();
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "stringpool.h"
+
+/*
+Chunks are aligned to their size, so the chunk a string belongs to is found by masking its address.
+A chunk counts the strings handed out from it, plus one while it is the one new strings are taken from.
+*/
+typedef struct PoolChunk
+{
+    struct PoolChunk *next;
+    struct PoolChunk *prev;
+    size_t used;
+    size_t size;
+    int refs;
+    char data[];
+} PoolChunk;
+
+#define POOL_CHUNK_CAPACITY (STRING_POOL_CHUNK_SIZE - sizeof(PoolChunk))
+
+static PoolChunk *poolChunks = NULL; // All chunks, so that those still in use can be freed at exit
+static PoolChunk *currentChunk = NULL;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char **directories = NULL;
+static int numDirectories = 0;
+static int directoriesCapacity = 0;
+static int *directoryTable = NULL; // Open addressing, holds id + 1 so that 0 is an empty slot
+static int directoryTableSize = 0;
+static pthread_mutex_t directoryMutex = PTHREAD_MUTEX_INITIALIZER;
+
+PoolChunk *newPoolChunk(size_t size)
+{
+    void *memory = NULL;
+
+    // Long strings get a chunk of their own so they don't waste the rest of the current one
+    if (posix_memalign(&memory, STRING_POOL_CHUNK_SIZE, sizeof(PoolChunk) + size) != 0)
+        return NULL;
+
+    PoolChunk *chunk = memory;
+    chunk->used = 0;
+    chunk->size = size;
+    chunk->refs = 0;
+    chunk->prev = NULL;
+    chunk->next = poolChunks;
+    if (poolChunks != NULL)
+        poolChunks->prev = chunk;
+    poolChunks = chunk;
+    return chunk;
+}
+
+void freePoolChunk(PoolChunk *chunk)
+{
+    if (chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+    else
+        poolChunks = chunk->next;
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+    free(chunk);
+}
+
+PoolChunk *getPoolChunk(const char *str)
+{
+    return (PoolChunk *)((uintptr_t)str & ~(uintptr_t)(STRING_POOL_CHUNK_SIZE - 1));
+}
+
+char *poolStrndup(const char *str, size_t length)
+{
+    PoolChunk *chunk;
+
+    if (str == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&poolMutex);
+
+    if (currentChunk != NULL && currentChunk->size - currentChunk->used >= length + 1)
+    {
+        chunk = currentChunk;
+    }
+    else if (length + 1 > POOL_CHUNK_CAPACITY / 4)
+    {
+        chunk = newPoolChunk(length + 1);
+    }
+    else
+    {
+        chunk = newPoolChunk(POOL_CHUNK_CAPACITY);
+        if (chunk != NULL)
+        {
+            if (currentChunk != NULL && --currentChunk->refs == 0)
+                freePoolChunk(currentChunk);
+            currentChunk = chunk;
+            chunk->refs = 1;
+        }
+    }
+
+    if (chunk == NULL)
+    {
+        pthread_mutex_unlock(&poolMutex);
+        return NULL;
+    }
+
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    chunk->used += length + 1;
+    chunk->refs++;
+
+    pthread_mutex_unlock(&poolMutex);
+    return copy;
+}
+
+char *poolStrdup(const char *str)
+{
+    if (str == NULL)
+        return NULL;
+    return poolStrndup(str, strlen(str));
+}
+
+void poolRetain(const char *str)
+{
+    if (str == NULL)
+        return;
+
+    pthread_mutex_lock(&poolMutex);
+    getPoolChunk(str)->refs++;
+    pthread_mutex_unlock(&poolMutex);
+}
+
+void poolRelease(const char *str)
+{
+    if (str == NULL)
+        return;
+
+    pthread_mutex_lock(&poolMutex);
+    PoolChunk *chunk = getPoolChunk(str);
+    if (--chunk->refs == 0)
+        freePoolChunk(chunk);
+    pthread_mutex_unlock(&poolMutex);
+}
+
+unsigned int hashDirectory(const char *path, size_t length)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int growDirectoryTable()
+{
+    int size = directoryTableSize > 0 ? directoryTableSize * 2 : 1024;
+    int *table = calloc(size, sizeof(int));
+    if (table == NULL)
+        return -1;
+
+    for (int id = 0; id < numDirectories; id++)
+    {
+        unsigned int slot = hashDirectory(directories[id], strlen(directories[id])) & (size - 1);
+        while (table[slot] != 0)
+            slot = (slot + 1) & (size - 1);
+        table[slot] = id + 1;
+    }
+
+    free(directoryTable);
+    directoryTable = table;
+    directoryTableSize = size;
+    return 0;
+}
+
+int internDirectory(const char *path, size_t length)
+{
+    int id = -1;
+
+    pthread_mutex_lock(&directoryMutex);
+
+    if ((numDirectories + 1) * 2 > directoryTableSize && growDirectoryTable() < 0)
+    {
+        pthread_mutex_unlock(&directoryMutex);
+        return -1;
+    }
+
+    unsigned int slot = hashDirectory(path, length) & (directoryTableSize - 1);
+    while (directoryTable[slot] != 0)
+    {
+        const char *existing = directories[directoryTable[slot] - 1];
+        if (strncmp(existing, path, length) == 0 && existing[length] == '\0')
+        {
+            id = directoryTable[slot] - 1;
+            pthread_mutex_unlock(&directoryMutex);
+            return id;
+        }
+        slot = (slot + 1) & (directoryTableSize - 1);
+    }
+
+    if (numDirectories == directoriesCapacity)
+    {
+        int capacity = directoriesCapacity > 0 ? directoriesCapacity * 2 : 256;
+        char **newDirectories = realloc(directories, capacity * sizeof(char *));
+        if (newDirectories == NULL)
+        {
+            pthread_mutex_unlock(&directoryMutex);
+            return -1;
+        }
+        directories = newDirectories;
+        directoriesCapacity = capacity;
+    }
+
+    // Directories are kept until exit, so they don't hold on to chunks of the pool
+    char *copy = strndup(path, length);
+    if (copy != NULL)
+    {
+        id = numDirectories++;
+        directories[id] = copy;
+        directoryTable[slot] = id + 1;
+    }
+
+    pthread_mutex_unlock(&directoryMutex);
+    return id;
+}
+
+const char *getInternedDirectory(int id)
+{
+    const char *path = NULL;
+
+    pthread_mutex_lock(&directoryMutex);
+    if (id >= 0 && id < numDirectories)
+        path = directories[id];
+    pthread_mutex_unlock(&directoryMutex);
+
+    return path;
+}
+
+void freeStringPool()
+{
+    pthread_mutex_lock(&directoryMutex);
+    for (int id = 0; id < numDirectories; id++)
+        free(directories[id]);
+    free(directories);
+    free(directoryTable);
+    directories = NULL;
+    directoryTable = NULL;
+    numDirectories = 0;
+    directoriesCapacity = 0;
+    directoryTableSize = 0;
+    pthread_mutex_unlock(&directoryMutex);
+
+    pthread_mutex_lock(&poolMutex);
+    while (poolChunks != NULL)
+        freePoolChunk(poolChunks);
+    currentChunk = NULL;
+    pthread_mutex_unlock(&poolMutex);
+}
@@ -0,0 +1,25 @@
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+#include <stddef.h>
+
+#define STRING_POOL_CHUNK_SIZE 65536
+
+// Strings handed out by the pool are immutable. Each one is given back with poolRelease(),
+// and a chunk is freed once none of its strings is used anymore.
+char *poolStrdup(const char *str);
+
+char *poolStrndup(const char *str, size_t length);
+
+// For a second owner of a string, it then needs one more poolRelease()
+void poolRetain(const char *str);
+
+void poolRelease(const char *str);
+
+// Directories are stored once and referred to by id, ids start at 0
+int internDirectory(const char *path, size_t length);
+
+const char *getInternedDirectory(int id);
+
+void freeStringPool();
+
+#endif
@@ -148,7 +148,7 @@ void getTermSize(int *width, int *height)
 void setDefaultTextColor()
 {
     printf("\033[0m");
-    fflush(stdout);
+    flushOutput();
 }
 
 void setNonblockingMode()
@@ -217,37 +217,37 @@ char readInput()
 void saveCursorPosition()
 {
     printf("\033[s");
-    fflush(stdout);
+    flushOutput();
 }
 
 void restoreCursorPosition()
 {
     printf("\033[u");
-    fflush(stdout);
+    flushOutput();
 }
 
 void setCursorPosition(int row, int col)
 {
     printf("\033[%d;%dH", row, col);
-    fflush(stdout);
+    flushOutput();
 }
 
 void hideCursor()
 {
     printf("\033[?25l");
-    fflush(stdout);
+    flushOutput();
 }
 
 void showCursor()
 {
     printf("\033[?25h");
-    fflush(stdout);
+    flushOutput();
 }
 
 void clearRestOfScreen()
 {
     printf("\033[J");
-    fflush(stdout);
+    flushOutput();
 }
 
 void clearScreen()
@@ -259,7 +259,7 @@ void clearScreen()
 void setWindowTitle(const char *title)
 {
     printf("\033]0;%s\007", title);
-    fflush(stdout);
+    flushOutput();
 }
 
 int getCurrentLine()
@@ -360,13 +360,13 @@ void cursorJump(int numRows)
 {
     printf("\033[%dA", numRows);
     printf("\033[0m");
-    fflush(stdout);
+    flushOutput();
 }
 
 void cursorJumpDown(int numRows)
 {
     printf("\033[%dB", numRows);
-    fflush(stdout);
+    flushOutput();
 }
 
 int readInputSequence(char *seq, size_t seqSize)
@@ -395,3 +395,39 @@ int readInputSequence(char *seq, size_t seqSize)
     seq[bytesRead] = '\0';
     return bytesRead;
 }
+
+/*
+Output between beginFrame() and endFrame() stays in stdout's buffer and goes out with a single flush at the end.
+The frame is wrapped in the synchronized update markers (DEC mode 2026), so terminals that know them show it
+at once. Other terminals ignore the markers. Frames may nest, only the outermost one counts.
+*/
+static int frameDepth = 0;
+static char outputBuffer[OUTPUT_BUFFER_SIZE];
+
+// stdout is fully buffered from the start, so newlines don't flush a frame early. Whatever has to be
+// seen right away is flushed explicitly, with flushOutput() or endFrame().
+void initOutputBuffer()
+{
+    setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+}
+
+void beginFrame()
+{
+    if (frameDepth++ == 0)
+        printf("\033[?2026h");
+}
+
+void endFrame()
+{
+    if (frameDepth == 0 || --frameDepth > 0)
+        return;
+    printf("\033[?2026l");
+    fflush(stdout);
+}
+
+// Flushes unless a frame is being built
+void flushOutput()
+{
+    if (frameDepth == 0)
+        fflush(stdout);
+}
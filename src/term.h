@@ -22,6 +22,7 @@
 #define ANSI_COLOR_RESET "\x1b[0m"
 #define ANSI_GET_CURSOR_POS "\033[6n"
 #define ANSI_SET_CURSOR_POS "\033[%d;%dH"
+#define OUTPUT_BUFFER_SIZE 1048576 // Room for a frame with a large cover
 
 extern volatile sig_atomic_t resizeFlag;
 
@@ -99,4 +100,12 @@ void clearScreen();
 
 int readInputSequence(char* seq, size_t seqSize);
 
+void initOutputBuffer();
+
+void beginFrame();
+
+void endFrame();
+
+void flushOutput();
+
 #endif
\ No newline at end of file
@@ -1,99 +1,54 @@
+#include <pwd.h>
+#include <unistd.h>
+#include <sys/param.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "visuals.h"
 #include "albumart.h"
+#include "beatdetect.h"
 #define SAMPLE_RATE 192000
-#define BUFFER_SIZE 1024
+#define FFT_SIZE 8192 // Bins of about 23 Hz, RECENT_FRAMES holds that many frames
 #define CHANNELS 2
-#define WINDOW_SIZE 1024
-#define BEAT_THRESHOLD 0.3
 #define MAGNITUDE_CEIL 300
 #define JUMP_AMOUNT 3.0
-int bufferIndex = 0;
+#define NUM_BINS (FFT_SIZE / 2 + 1)
+#define LOWEST_FREQUENCY 40.0
+#define HIGHEST_FREQUENCY 20000.0
+// A full scale sine reads about 512, like it did without the window on 1024 samples
+#define MAGNITUDE_SCALE (2048.0f / FFT_SIZE)
 
-float magnitudeBuffer[WINDOW_SIZE] = {0.0f};
+const char WISDOM_FILENAME[] = ".cue.wisdom";
 
-void updateMagnitudeBuffer(float magnitude)
+// The plan and its buffers are made once, a frame only copies samples in and executes it
+typedef struct
 {
-    magnitudeBuffer[bufferIndex] = magnitude;
-    bufferIndex = (bufferIndex + 1) % WINDOW_SIZE;
-}
-
-float calculateMovingAverage()
-{
-    float sum = 0.0f;
-    int numSamples = 0;
-    for (int i = 0; i < WINDOW_SIZE; i++)
-    {
-        sum += magnitudeBuffer[i];
-        if (magnitudeBuffer[i] > 0.0f)
-        {
-            numSamples++;
-        }
-    }
-    numSamples = (numSamples > 0) ? numSamples : 1;
-    return sum / numSamples;
-}
-
-float calculateThreshold()
-{
-    float sum = 0.0f;
-    int numSamples = 0;
-    for (int i = 0; i < WINDOW_SIZE; i++)
-    {
-        sum += magnitudeBuffer[i];
-        if (magnitudeBuffer[i] > 0.0f)
-        {
-            numSamples++;
-        }
-    }
-    numSamples = (numSamples > 0) ? numSamples : 1;
-    float mean = sum / numSamples;
-
-    float variance = 0.0f;
-    for (int i = 0; i < WINDOW_SIZE; i++)
-    {
-        float diff = magnitudeBuffer[i] - mean;
-        variance += diff * diff;
-    }
-    variance /= numSamples;
-
-    float stdDeviation = sqrtf(variance);
-    float threshold = mean + (stdDeviation * BEAT_THRESHOLD);
-
-    return threshold;
-}
-
-int detectBeats(float *magnitudes, int numBars)
-{
-    float avgMagnitude = 0.0f;
-    int range = 2;
-    range = (range > numBars) ? numBars : range;
-
-    for (int i = 0; i < range; i++)
-    {
-        float magnitude = magnitudes[i];
-        avgMagnitude += magnitude;
-    }
-    avgMagnitude /= range;
-    updateMagnitudeBuffer(avgMagnitude);
-    float threshold = calculateThreshold();
-
-    for (int i = 0; i < range; i++)
-    {
-        if (magnitudes[i] > threshold)
-        {
-            return 1;
-        }
-    }
-    return 0;
-}
+    float *input;
+    fftwf_complex *output;
+    fftwf_plan plan;
+    bool measured;
+    float window[FFT_SIZE];
+    float frames[FFT_SIZE * CHANNELS];
+    float power[NUM_BINS];
+    int *bandStart; // The bins of each bar, from bandStart up to but not including bandEnd
+    int *bandEnd;
+    int numBands;
+} SpectrumAnalyzer;
+
+static SpectrumAnalyzer analyzer;
+
+static BeatDetector beatDetector;
 
 void updateMagnitudes(int height, int width, float maxMagnitude, float *magnitudes)
 {
     float exponent = 1.0;
     float jumpFactor = 1.0;
 
-    int beat = detectBeats(magnitudes, width);
-    if (beat > 0)
+    // Only the bass makes the bars jump
+    int beats = detectBeat(&beatDetector, magnitudes, width);
+    if (beats & 1)
     {
         jumpFactor = JUMP_AMOUNT;
     }
@@ -133,47 +88,172 @@ float calcMaxMagnitude(int numBars, float *magnitudes)
     return maxMagnitude;
 }
 
-void clearMagnitudes(int width, float *magnitudes)
+void getWisdomFilePath(char *filePath)
 {
-    for (int i = 0; i < width; i++)
-    {
-        magnitudes[i] = 0.0f;
-    }
+    struct passwd *pw = getpwuid(getuid());
+    snprintf(filePath, MAXPATHLEN, "%s/%s", pw->pw_dir, WISDOM_FILENAME);
 }
 
-void calcSpectrum(int height, int width, fftwf_complex *fftInput, fftwf_complex *fftOutput, float *magnitudes, fftwf_plan plan)
+// With visualizerMeasure FFTW times a few ways of doing the transform and keeps the fastest. What it found is
+// stored in the wisdom file, so that only the first run pays for the measuring.
+int initSpectrumAnalyzer()
 {
-    if (g_audioBuffer == NULL)
+    char wisdomPath[MAXPATHLEN];
+    unsigned int flags = FFTW_ESTIMATE;
+
+    if (analyzer.plan != NULL)
+        return 0;
+
+    analyzer.input = fftwf_alloc_real(FFT_SIZE);
+    analyzer.output = fftwf_alloc_complex(NUM_BINS);
+    if (analyzer.input == NULL || analyzer.output == NULL)
     {
-        return;
+        freeSpectrumAnalyzer();
+        return -1;
+    }
+
+    if (visualizerMeasure)
+    {
+        getWisdomFilePath(wisdomPath);
+        fftwf_import_wisdom_from_filename(wisdomPath);
+        flags = FFTW_MEASURE;
     }
 
-    for (int i = 0; i < BUFFER_SIZE; i++)
+    // Planning with FFTW_MEASURE overwrites the buffers, nothing is in them yet
+    analyzer.plan = fftwf_plan_dft_r2c_1d(FFT_SIZE, analyzer.input, analyzer.output, flags);
+    if (analyzer.plan == NULL)
     {
-        ma_int32 sample = g_audioBuffer[i];
-        // Extract the lower 24 bits from the sample
-        int lower24Bits = sample & 0xFFFFFF;
+        freeSpectrumAnalyzer();
+        return -1;
+    }
 
-        // Check if the 24th bit is set (indicating a negative value)
-        if (lower24Bits & 0x800000)
+    // Hann window, so that loud bins don't leak into the bars next to them
+    for (int i = 0; i < FFT_SIZE; i++)
+        analyzer.window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / (FFT_SIZE - 1));
+
+    analyzer.measured = visualizerMeasure;
+    return 0;
+}
+
+void freeSpectrumAnalyzer()
+{
+    char wisdomPath[MAXPATHLEN];
+
+    if (analyzer.plan != NULL)
+    {
+        if (analyzer.measured)
         {
-            // Extend the sign to 32 bits
-            lower24Bits |= 0xFF000000;
+            getWisdomFilePath(wisdomPath);
+            fftwf_export_wisdom_to_filename(wisdomPath);
         }
+        fftwf_destroy_plan(analyzer.plan);
+    }
+    fftwf_free(analyzer.input);
+    fftwf_free(analyzer.output);
+    free(analyzer.bandStart);
+    analyzer.input = NULL;
+    analyzer.output = NULL;
+    analyzer.plan = NULL;
+    analyzer.measured = false;
+    analyzer.bandStart = NULL;
+    analyzer.bandEnd = NULL;
+    analyzer.numBands = 0;
+    freeBeatDetector(&beatDetector);
+}
+
+// The bars are spread evenly over a log scale from LOWEST_FREQUENCY to HIGHEST_FREQUENCY, but each bar gets
+// at least a bin of its own. Every bar takes an equal log share of what is left of the range, so when the low
+// bars are widened to a bin the ones above them are spread over the rest. Only done again when the number of bars changes.
+int calcBands(int numBars)
+{
+    if (numBars == analyzer.numBands)
+        return 0;
+
+    int *bands = malloc(sizeof(int) * numBars * 2);
+    if (bands == NULL)
+        return -1;
+
+    free(analyzer.bandStart);
+    analyzer.bandStart = bands;
+    analyzer.bandEnd = bands + numBars;
+    analyzer.numBands = numBars;
+
+    double binWidth = (double)SAMPLE_RATE / FFT_SIZE;
+    double highest = fmin(HIGHEST_FREQUENCY, SAMPLE_RATE / 2.0);
+    int start = (int)(LOWEST_FREQUENCY / binWidth + 0.5);
+    start = (start < 1) ? 1 : start;
+
+    for (int i = 0; i < numBars; i++)
+    {
+        double low = start * binWidth;
+        double high = low * pow(highest / low, 1.0 / (numBars - i));
+        int end = (int)(high / binWidth + 0.5);
+
+        start = (start > NUM_BINS - 1) ? NUM_BINS - 1 : start;
+        end = (end <= start) ? start + 1 : (end > NUM_BINS ? NUM_BINS : end);
+
+        analyzer.bandStart[i] = start;
+        analyzer.bandEnd[i] = end;
+        start = end;
+    }
+    return 0;
+}
+
+// re * re + im * im of each bin, four bins at a time with SSE or NEON
+void calcPower(const float *bins, float *power, int numBins)
+{
+    int i = 0;
+
+#if defined(__SSE__)
+    for (; i + 4 <= numBins; i += 4)
+    {
+        __m128 first = _mm_loadu_ps(bins + 2 * i);
+        __m128 second = _mm_loadu_ps(bins + 2 * i + 4);
+        __m128 re = _mm_shuffle_ps(first, second, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 im = _mm_shuffle_ps(first, second, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(power + i, _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= numBins; i += 4)
+    {
+        float32x4x2_t bin = vld2q_f32(bins + 2 * i);
+        vst1q_f32(power + i, vmlaq_f32(vmulq_f32(bin.val[0], bin.val[0]), bin.val[1], bin.val[1]));
+    }
+#endif
+
+    for (; i < numBins; i++)
+        power[i] = bins[2 * i] * bins[2 * i] + bins[2 * i + 1] * bins[2 * i + 1];
+}
+
+void calcSpectrum(int height, int width, float *magnitudes)
+{
+    if (calcBands(width) != 0)
+    {
+        return;
+    }
+
+    // The most recent frames, so windows overlap whenever frames are drawn faster than FFT_SIZE samples play
+    getRecentFrames(analyzer.frames, FFT_SIZE);
 
-        // Normalize the 24-bit sample to the range [-1, 1]
-        float normalizedSample = (float)lower24Bits / 8388608.0f;
-        fftInput[i][0] = normalizedSample;
-        fftInput[i][1] = 0;
+    for (int i = 0; i < FFT_SIZE; i++)
+    {
+        float sum = 0.0f;
+        for (int channel = 0; channel < CHANNELS; channel++)
+            sum += analyzer.frames[i * CHANNELS + channel];
+        analyzer.input[i] = sum / CHANNELS * analyzer.window[i];
     }
 
-    fftwf_execute(plan);
-    clearMagnitudes(width, magnitudes);
+    fftwf_execute(analyzer.plan);
+
+    // Squared magnitudes, the square root is taken once per bar
+    calcPower((const float *)analyzer.output, analyzer.power, analyzer.bandEnd[width - 1]);
 
     for (int i = 0; i < width; i++)
     {
-        float magnitude = sqrtf(fftOutput[i][0] * fftOutput[i][0] + fftOutput[i][1] * fftOutput[i][1]);
-        magnitudes[i] += magnitude;
+        float peak = 0.0f;
+        for (int bin = analyzer.bandStart[i]; bin < analyzer.bandEnd[i]; bin++)
+            peak = (analyzer.power[bin] > peak) ? analyzer.power[bin] : peak;
+        magnitudes[i] = sqrtf(peak) * MAGNITUDE_SCALE;
     }
 
     float maxMagnitude = calcMaxMagnitude(width, magnitudes);
@@ -200,66 +280,50 @@ PixelData decreaseLuminosity(PixelData pixel, int amount)
     return pixel2;
 }
 
-void printSpectrum(int height, int width, float *magnitudes, PixelData color)
+// Bars take two columns, a gap and the bar. The top row is white and the rows below fade from a brighter accent colour.
+void printSpectrum(ScreenRegion *screen, int row, int height, int width, float *magnitudes, PixelData color)
 {
-    printf("\n");
-    fflush(stdout);
-    clearRestOfScreen();
+    bool defaultColor = (color.r == 0 && color.g == 0 && color.b == 0);
 
-    for (int j = height; j > 0; j--)
+    for (int j = height; j > 0; j--, row++)
     {
-        printf("\r");
+        PixelData rowColor = color;
 
-        if (color.r != 0 || color.g != 0 || color.b != 0)
+        if (!defaultColor)
         {
             if (j == height)
             {
-                printf("\033[38;2;%d;%d;%dm", 255, 255, 255);
+                rowColor.r = rowColor.g = rowColor.b = 255;
             }
             else if (j == height - 1)
             {
                 color = increaseLuminosity(color, 60);
-                printf("\033[38;2;%d;%d;%dm", color.r, color.g, color.b);
+                rowColor = color;
             }
             else
             {
                 color = decreaseLuminosity(color, 25);
-                printf("\033[38;2;%d;%d;%dm", color.r, color.g, color.b);
+                rowColor = color;
             }
         }
-        else
-        {
-            setDefaultTextColor();
-        }
+
         for (int i = 0; i < width; i++)
         {
-            if (j >= 0)
-            {
-                if ((int)round(magnitudes[i]) >= j)
-                {
-                    printf(" █");
-                }
-                else
-                {
-                    printf("  ");
-                }
-            }
+            screenPut(screen, row, i * 2, " ", rowColor, defaultColor);
+            screenPut(screen, row, i * 2 + 1, (int)round(magnitudes[i]) >= j ? "█" : " ", rowColor, defaultColor);
         }
-        printf("\n ");
     }
-    printf("\r");
+
     color = decreaseLuminosity(color, 25);
-    printf("\033[38;2;%d;%d;%dm", color.r, color.g, color.b);
     for (int i = 0; i < width; i++)
     {
-        printf(" █");
+        screenPut(screen, row, i * 2, " ", color, false);
+        screenPut(screen, row, i * 2 + 1, "█", color, false);
     }
-    printf("\n");
-    printf("\r");
-    fflush(stdout);
 }
 
-void drawSpectrumVisualizer(int height, int width, PixelData c)
+// Draws into the rows from row on, height - 1 rows of bars and the base row
+void drawSpectrumVisualizer(ScreenRegion *screen, int row, int height, int width, PixelData c)
 {
     PixelData color;
     color.r = c.r;
@@ -269,34 +333,18 @@ void drawSpectrumVisualizer(int height, int width, PixelData c)
     int numBars = (width / 2);
     height = height - 1;
 
-    if (height <= 0 || width <= 0)
+    if (height <= 0 || numBars <= 0)
     {
         return;
     }
 
-    fftwf_complex *fftInput = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * BUFFER_SIZE);
-    if (fftInput == NULL)
+    if (initSpectrumAnalyzer() != 0)
     {
         return;
     }
 
-    fftwf_complex *fftOutput = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * BUFFER_SIZE);
-    if (fftOutput == NULL)
-    {
-        fftwf_free(fftInput);
-        return;
-    }
-
-    fftwf_plan plan = fftwf_plan_dft_1d(BUFFER_SIZE, fftInput, fftOutput, FFTW_FORWARD, FFTW_ESTIMATE);
-
     float magnitudes[numBars];
 
-    calcSpectrum(height, numBars, fftInput, fftOutput, magnitudes, plan);
-    printSpectrum(height, numBars, magnitudes, color);
-
-    fftwf_destroy_plan(plan);
-    fftwf_free(fftInput);
-    fftInput = NULL;
-    fftwf_free(fftOutput);
-    fftOutput = NULL;
+    calcSpectrum(height, numBars, magnitudes);
+    printSpectrum(screen, row, height, numBars, magnitudes, color);
 }
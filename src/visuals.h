@@ -1,5 +1,6 @@
 #include <math.h>
 #include <float.h>
+#include <stdbool.h>
 #include <fftw3.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,8 +8,13 @@
 #include "soundgapless.h"
 #include "term.h"
 #include "write_ascii.h"
+#include "screen.h"
 
-void drawSpectrumVisualizer(int height, int width, PixelData c);
+extern bool visualizerMeasure;
+
+void drawSpectrumVisualizer(ScreenRegion *screen, int row, int height, int width, PixelData c);
+
+void freeSpectrumAnalyzer();
 
 PixelData increaseLuminosity(PixelData pixel, int amount);
 
@@ -0,0 +1,119 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/beatdetect.h"
+
+/*
+Feeds detectBeat() synthetic spectra: a noise floor with a kick every KICK_INTERVAL frames in some of the bars,
+and checks in which frames and bands onsets are reported.
+*/
+
+#define NUM_BARS 40
+#define NUM_FRAMES 3000
+#define KICK_INTERVAL 15
+
+// Noise between 10 and 12 everywhere, bars from kickStart up to kickEnd get 40 more on a kick
+void fillFrame(float *magnitudes, bool kick, int kickStart, int kickEnd)
+{
+    for (int i = 0; i < NUM_BARS; i++)
+    {
+        magnitudes[i] = 10.0f + (rand() % 100) / 50.0f;
+        if (kick && i >= kickStart && i < kickEnd)
+            magnitudes[i] += 40.0f;
+    }
+}
+
+void testSteadySpectrum()
+{
+    BeatDetector detector = {0};
+    float magnitudes[NUM_BARS];
+
+    for (int i = 0; i < NUM_BARS; i++)
+        magnitudes[i] = 25.0f;
+
+    for (int frame = 0; frame < NUM_FRAMES; frame++)
+        assert(detectBeat(&detector, magnitudes, NUM_BARS) == 0);
+
+    freeBeatDetector(&detector);
+}
+
+// Every kick in the given bars has to fire their band and nothing but a kick may, the other bands only get noise
+void testKicks(int kickStart, int kickEnd, int band)
+{
+    BeatDetector detector = {0};
+    float magnitudes[NUM_BARS];
+    int kicks = 0, hits = 0, falseHits = 0;
+    int noiseOnsets[BEAT_BANDS] = {0};
+
+    srand(1);
+    for (int frame = 0; frame < NUM_FRAMES; frame++)
+    {
+        bool kick = (frame % KICK_INTERVAL == 0);
+        fillFrame(magnitudes, kick, kickStart, kickEnd);
+
+        int beats = detectBeat(&detector, magnitudes, NUM_BARS);
+
+        // Until the history is full nothing is reported
+        if (frame <= BEAT_HISTORY)
+        {
+            assert(beats == 0);
+            continue;
+        }
+
+        if (kick)
+        {
+            kicks++;
+            hits += (beats >> band) & 1;
+        }
+        else
+        {
+            falseHits += (beats >> band) & 1;
+        }
+        for (int other = 0; other < BEAT_BANDS; other++)
+            noiseOnsets[other] += (other != band) && ((beats >> other) & 1);
+    }
+
+    assert(hits == kicks);
+    assert(falseHits == 0);
+
+    // The other bands only see noise, at 1.5 deviations above the mean a few frames still pass
+    for (int other = 0; other < BEAT_BANDS; other++)
+        assert(noiseOnsets[other] * 10 < NUM_FRAMES);
+
+    freeBeatDetector(&detector);
+}
+
+void testBarCountChange()
+{
+    BeatDetector detector = {0};
+    float magnitudes[NUM_BARS];
+
+    srand(2);
+    for (int frame = 0; frame < 4 * BEAT_HISTORY; frame++)
+    {
+        fillFrame(magnitudes, frame % KICK_INTERVAL == 0, 0, 10);
+        detectBeat(&detector, magnitudes, NUM_BARS);
+    }
+
+    // A new number of bars starts over, the next frames are only history
+    fillFrame(magnitudes, true, 0, 10);
+    for (int frame = 0; frame <= BEAT_HISTORY; frame++)
+        assert(detectBeat(&detector, magnitudes, NUM_BARS / 2) == 0);
+    assert(detector.numBars == NUM_BARS / 2);
+
+    // Too few bars to split into bands
+    assert(detectBeat(&detector, magnitudes, BEAT_BANDS - 1) == 0);
+
+    freeBeatDetector(&detector);
+}
+
+int main()
+{
+    testSteadySpectrum();
+    testKicks(0, 10, 0);
+    testKicks(30, 40, 3);
+    testBarCountChange();
+    printf("beatdetect: all tests passed\n");
+    return 0;
+}